@@ -0,0 +1,87 @@
+/* Sequential throughput of a block device for a given I/O size, used to
+ * compare embb_gpio queue settings (logical_bs, physical_bs, io_opt).
+ * O_DIRECT bypasses the page cache so every call reaches the driver.
+ *
+ * usage: blkbench [dev] [bs] [seconds]
+ *   blkbench /dev/embbGpioA 4096 5
+ *   blkbench /dev/embbGpioA 1048576 5
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/fs.h>           //BLKGETSIZE64
+
+#define DEVPATH "/dev/embbGpioA"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Sweeps the whole device sequentially until @secs elapse, wraps around */
+static double run(int fd, char *buf, size_t bs, off_t dev_sz, int secs,
+        int write)
+{
+    double start = now(), end = start + secs, t = start;
+    unsigned long long bytes = 0;
+    off_t pos = 0;
+    while(t < end)
+    {
+        ssize_t ret = write ? pwrite(fd, buf, bs, pos) : pread(fd, buf, bs, pos);
+        if(ret != (ssize_t)bs)
+        {
+            perror(write ? "pwrite" : "pread");
+            exit(EXIT_FAILURE);
+        }
+        bytes += bs;
+        pos += bs;
+        if(pos + (off_t)bs > dev_sz)
+            pos = 0;
+        //checking the clock every call would dominate for small bs
+        if( !(bytes/bs % 64) )
+            t = now();
+    }
+    return bytes / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : DEVPATH;
+    size_t bs = argc > 2 ? strtoul(argv[2], NULL, 0) : 4096;
+    int secs = argc > 3 ? atoi(argv[3]) : 5;
+    int fd = open(path, O_RDWR | O_DIRECT);
+    if(fd<0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long long dev_sz = 0;
+    if( ioctl(fd, BLKGETSIZE64, &dev_sz) < 0 || dev_sz < bs )
+    {
+        fprintf(stderr, "device smaller than bs\n");
+        exit(EXIT_FAILURE);
+    }
+    char *buf = NULL;
+    if( posix_memalign((void **)&buf, 4096, bs) )
+    {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 0xa5, bs);
+    double wr = run(fd, buf, bs, dev_sz, secs, 1);
+    double rd = run(fd, buf, bs, dev_sz, secs, 0);
+    //one line per run, easy to paste into a table
+    printf("bs=%zu write=%.1f MiB/s read=%.1f MiB/s\n", bs,
+            wr/(1<<20), rd/(1<<20));
+    free(buf);
+    close(fd);
+    return 0;
+}
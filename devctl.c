@@ -4,22 +4,30 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <unistd.h>
+#include <string.h>
 
 #define DEVPATH "/dev/embbGpioA"
 #define EMBB_GPIO_MAGIC 'E'         // 8-bit magic number
 #define EMBB_GPIO_TEST _IO(EMBB_GPIO_MAGIC,3)
+#define EMBB_GPIO_SNAPSHOT _IO(EMBB_GPIO_MAGIC,4)
+#define EMBB_GPIO_SNAPSHOT_WAIT _IO(EMBB_GPIO_MAGIC,5)
 
+/* usage: devctl [test|snapshot|wait] */
 int main(int argc, char** argv)
 {
     int fd;
+    unsigned long cmd = EMBB_GPIO_TEST;
+    if(argc > 1 && !strcmp(argv[1], "snapshot"))
+        cmd = EMBB_GPIO_SNAPSHOT;
+    else if(argc > 1 && !strcmp(argv[1], "wait"))
+        cmd = EMBB_GPIO_SNAPSHOT_WAIT;
     fd = open(DEVPATH, O_RDWR);
     if(fd<0)
     {
         perror("opening");
         exit(EXIT_FAILURE);
     }
-    if( ioctl(fd, EMBB_GPIO_TEST) <0)
+    if( ioctl(fd, cmd) <0)
         perror("ioctl error");
     fprintf(stderr, "U: device opened\n");
     close(fd);
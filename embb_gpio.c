@@ -1,4 +1,5 @@
 #include <linux/module.h>       //MODULE_AUTHOR etc.
+#include <linux/moduleparam.h>  //module_param
 #include <linux/slab.h>         //kzalloc
 #include <linux/interrupt.h>    //irq_handler_t
 #include <linux/fs.h>           //register_blkdev
@@ -6,8 +7,16 @@
 #include <linux/spinlock_types.h>     //spinlock
 #include <linux/spinlock.h>     //spinlock
 #include <linux/blkdev.h>       //request queue blk_queue_hardsect_size
+#include <linux/blk-mq.h>       //multi-queue tag set
 #include <linux/vmalloc.h>      //vmalloc
+#include <linux/highmem.h>      //kmap_atomic
+#include <linux/log2.h>         //is_power_of_2
 #include <linux/ioctl.h>        //ioctl command
+#include <linux/workqueue.h>    //snapshot work
+#include <linux/bitops.h>       //dirty bitmap
+#include <linux/string.h>       //memchr_inv
+#include <linux/suspend.h>      //pm notifier
+#include <linux/rcupdate.h>     //pages freed by discard
 //#include <asm-generic/uaccess.h>     //VERIFY_READ and VERIFY_WRITE
 #define MINOR_FIRST 0           //first requested minor
 #define MINOR_NB 1              //nb of minors requested
@@ -18,6 +27,8 @@
 #define PL011_LCR(base) PL011_OFFSET( (base), 0x2c)
 
 #define KERNEL_SECTOR_SIZE	512
+#define SECTOR_SHIFT_512 9
+#define PAGE_SECTORS (PAGE_SIZE >> SECTOR_SHIFT_512)
 #define EMBB_GPIO_ADD 0x40000000
 #define EMBB_GPIO_DEV_NAME "embbGpioDev"    //visible in /proc/devices
 #define EMBB_GPIO_DISK_NAME "embbGpio"  //visible in /dev
@@ -46,7 +57,10 @@
 #define EMBB_GPIO_GET_FIFO_TH _IOR(EMBB_GPIO_MAGIC, 1, int)
 #define EMBB_GPIO_SET_FIFO_TH _IOW(EMBB_GPIO_MAGIC, 2, int)
 #define EMBB_GPIO_TEST _IO(EMBB_GPIO_MAGIC,3)
-#define EMBB_GPIO_MAXNR 3
+#define EMBB_GPIO_SNAPSHOT _IO(EMBB_GPIO_MAGIC,4)         //start in background
+#define EMBB_GPIO_SNAPSHOT_WAIT _IO(EMBB_GPIO_MAGIC,5)    //wait, get status
+#define EMBB_GPIO_MAXNR 5
+#define EMBB_GPIO_SNAP_BATCH 16     //pages gathered into one write
 
 typedef struct EmbbGpioDev EmbbGpioDev;
 
@@ -54,22 +68,405 @@ struct EmbbGpioDev
 {
     int major;
     size_t minorsNb;
-    u16 hardSect;
+    unsigned int hardSect;
     size_t nSectors;
     size_t size;
     struct gendisk *gd;
     struct request_queue *rq;
-    u8 *data;
-    spinlock_t rqLock;
+    /* Backing store is kept per page, a NULL entry is a hole which reads as
+     * zeroes. Pages are allocated on first write and given back on discard,
+     * so the disk costs only as much memory as is actually in use. Lookups
+     * and copies run under rcu_read_lock, discard frees after a grace
+     * period, so a copy never touches a page that is gone. */
+    struct page **pages;
+    size_t nPages;
+    /* One hardware context per CPU: a request is served and completed on the
+     * CPU that submitted it, there is no lock shared between queues. */
+    struct blk_mq_tag_set tagSet;
+    /* Snapshot to a backing file: a bit per page tells it changed since the
+     * last snapshot, only those pages are written. */
+    unsigned long *dirty;
+    struct file *backing;
+    struct work_struct snapWork;
+    u8 *snapBuf;
+    int snapErr;
+    struct notifier_block pmNb;
 };
 
 static const int irq_nb = 0x14;         //first column in 'cat /proc/interrupts' output
 static EmbbGpioDev *devPtr = NULL;
 
-static void embbGpioReqHandler(struct request_queue *rq)
-{   /* Handler for queued requests */
+/* Geometry and queue limits, sizes in bytes unless stated otherwise. For the
+ * 4 KiB packet workload load with logical_bs=4096 physical_bs=4096
+ * io_opt=4096 so that the block layer neither splits nor merges packets.
+ */
+static uint logical_bs = KERNEL_SECTOR_SIZE;
+static uint physical_bs = 0;            //0: same as logical_bs
+static uint io_opt = 0;                 //0: no preference
+static uint max_sectors = 2048;         //max_hw_sectors, in 512-byte units
+static uint queue_depth = 128;          //per hardware queue
+static char *backing_file = NULL;       //NULL: contents are not persisted
+static ulong nsectors = EMBB_GPIO_NSECTORS;     //in logical_bs units
+
+module_param(logical_bs, uint, S_IRUGO);
+MODULE_PARM_DESC(logical_bs, "logical block size, power of 2 in [512, PAGE_SIZE]");
+module_param(physical_bs, uint, S_IRUGO);
+MODULE_PARM_DESC(physical_bs, "physical block size, >= logical_bs");
+module_param(io_opt, uint, S_IRUGO);
+MODULE_PARM_DESC(io_opt, "optimal I/O size");
+module_param(max_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(max_sectors, "largest request in 512-byte sectors");
+module_param(nsectors, ulong, S_IRUGO);
+MODULE_PARM_DESC(nsectors, "disk size in logical blocks");
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "tags per hardware (per-CPU) queue");
+module_param(backing_file, charp, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "file restored on load and used for snapshots");
+
+/* Returns the page backing @sector, allocating it if @alloc is set.
+ * Queues on different CPUs may race to fill the same hole, the slot is
+ * claimed with cmpxchg and the loser frees its page, so no lock is needed.
+ * ->queue_rq must not sleep, hence atomic allocation; the page comes from the
+ * node of the submitting CPU.
+ */
+static struct page *embbGpioPage(EmbbGpioDev *dev, sector_t sector, bool alloc)
+{
+    size_t idx = sector / PAGE_SECTORS;
+    struct page *page = READ_ONCE(dev->pages[idx]);
+    struct page *old;
+    if( page || !alloc )
+        return page;
+    page = alloc_page(GFP_ATOMIC | __GFP_NOWARN | __GFP_ZERO | __GFP_HIGHMEM);
+    if( !page )
+        return NULL;
+    old = cmpxchg(&dev->pages[idx], NULL, page);
+    if(old)
+    {
+        __free_page(page);
+        page = old;
+    }
+    return page;
+}
+
+/* Copies @len bytes between @buf and the disk starting at @sector, @len may
+ * span several backing pages.
+ */
+static blk_status_t embbGpioCopy(EmbbGpioDev *dev, sector_t sector, u8 *buf,
+        size_t len, bool write)
+{
+    while(len)
+    {
+        size_t offset = (sector % PAGE_SECTORS) << SECTOR_SHIFT_512;
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+        size_t idx = sector / PAGE_SECTORS;
+        struct page *page;
+        u8 *mem;
+        rcu_read_lock();
+        page = embbGpioPage(dev, sector, write);
+        if( !page )
+        {
+            rcu_read_unlock();
+            if(write)
+                return BLK_STS_RESOURCE;
+            memset(buf, 0, chunk);      //hole
+        }
+        else
+        {
+            mem = kmap_atomic(page);
+            if(write)
+                memcpy(mem + offset, buf, chunk);
+            else
+                memcpy(buf, mem + offset, chunk);
+            kunmap_atomic(mem);
+            rcu_read_unlock();
+            /* marked after the copy: a snapshot that clears the bit while
+             * the copy runs gets the page again next time */
+            if( write && dev->dirty )
+            {
+                smp_mb__before_atomic();
+                set_bit(idx, dev->dirty);
+            }
+        }
+        buf += chunk;
+        sector += chunk >> SECTOR_SHIFT_512;
+        len -= chunk;
+    }
+    return BLK_STS_OK;
+}
+
+static void embbGpioPageRcuFree(struct rcu_head *head)
+{
+    __free_page(container_of(head, struct page, rcu_head));
+}
+
+/* Discard and write-zeroes end up the same for a RAM disk: pages fully inside
+ * the range are freed (holes read back as zeroes), the partially covered ones
+ * at both ends are zeroed in place.
+ */
+static void embbGpioDiscard(EmbbGpioDev *dev, sector_t sector,
+        unsigned int nSect)
+{
+    while(nSect)
+    {
+        size_t offset = sector % PAGE_SECTORS;
+        unsigned int chunk = min_t(unsigned int, nSect, PAGE_SECTORS - offset);
+        size_t idx = sector / PAGE_SECTORS;
+        struct page *page;
+        rcu_read_lock();
+        page = READ_ONCE(dev->pages[idx]);
+        if( page && chunk == PAGE_SECTORS )
+        {
+            /* I/O overlapping an in-flight discard gets undefined data, but
+             * a copy on another queue may still hold the page: it is only
+             * freed once every such reader is done */
+            page = xchg(&dev->pages[idx], NULL);
+            if(page)
+                call_rcu(&page->rcu_head, embbGpioPageRcuFree);
+        }
+        else if(page)
+        {
+            u8 *mem = kmap_atomic(page);
+            memset(mem + (offset << SECTOR_SHIFT_512), 0,
+                    chunk << SECTOR_SHIFT_512);
+            kunmap_atomic(mem);
+        }
+        rcu_read_unlock();
+        if( page && dev->dirty )
+            set_bit(idx, dev->dirty);
+        sector += chunk;
+        nSect -= chunk;
+    }
+}
+
+static void embbGpioFreePages(EmbbGpioDev *dev)
+{
+    size_t i=0;
+    //pages discarded earlier, and the callback is module code
+    rcu_barrier();
+    for(; i<dev->nPages; i++)
+        if(dev->pages[i])
+            __free_page(dev->pages[i]);
+    vfree(dev->pages);
+    dev->pages = NULL;
 }
 
+/* Copies page @idx into @buf for the snapshot, a hole gives zeroes */
+static void embbGpioSnapPage(EmbbGpioDev *dev, size_t idx, u8 *buf)
+{
+    struct page *page;
+    rcu_read_lock();
+    page = READ_ONCE(dev->pages[idx]);
+    if(page)
+    {
+        u8 *mem = kmap_atomic(page);
+        memcpy(buf, mem, PAGE_SIZE);
+        kunmap_atomic(mem);
+    }
+    else
+        memset(buf, 0, PAGE_SIZE);
+    rcu_read_unlock();
+}
+
+/* Background snapshot: writes every dirty page to the backing file at the
+ * same offset as on the disk. Runs of consecutive dirty pages go out in one
+ * write of up to EMBB_GPIO_SNAP_BATCH pages. The queue is frozen while a
+ * batch is copied, so no page is caught half written; the file write runs
+ * with I/O going again. A page is only dirty once the disk is live, so the
+ * queue exists whenever there is a batch.
+ */
+static void embbGpioSnapWork(struct work_struct *work)
+{
+    EmbbGpioDev *dev = container_of(work, EmbbGpioDev, snapWork);
+    size_t idx = find_first_bit(dev->dirty, dev->nPages);
+    int err = 0;
+    while( idx < dev->nPages )
+    {
+        size_t n = 0;
+        loff_t pos = (loff_t)idx << PAGE_SHIFT;
+        ssize_t ret;
+        blk_mq_freeze_queue(dev->rq);
+        while( n < EMBB_GPIO_SNAP_BATCH && idx + n < dev->nPages &&
+                test_and_clear_bit(idx + n, dev->dirty) )
+        {
+            embbGpioSnapPage(dev, idx + n, dev->snapBuf + n*PAGE_SIZE);
+            n++;
+        }
+        blk_mq_unfreeze_queue(dev->rq);
+        ret = kernel_write(dev->backing, dev->snapBuf, n*PAGE_SIZE, &pos);
+        if( ret != n*PAGE_SIZE )
+        {
+            //keep the pages dirty so the next snapshot retries them
+            bitmap_set(dev->dirty, idx, n);
+            err = ret < 0 ? ret : -EIO;
+            break;
+        }
+        idx = find_next_bit(dev->dirty, dev->nPages, idx + n);
+    }
+    if( !err )
+        err = vfs_fsync(dev->backing, 1);
+    dev->snapErr = err;
+    if(err)
+        printk(KERN_WARNING "snapshot failed: %d\n", err);
+}
+
+/* Fills the disk from the backing file before it goes live. All-zero pages
+ * are left as holes so a sparse image stays sparse in memory.
+ */
+static int embbGpioRestore(EmbbGpioDev *dev)
+{
+    size_t idx = 0;
+    loff_t pos = 0;
+    while( idx < dev->nPages )
+    {
+        ssize_t ret = kernel_read(dev->backing, dev->snapBuf,
+                EMBB_GPIO_SNAP_BATCH*PAGE_SIZE, &pos);
+        size_t i = 0;
+        if(ret < 0)
+            return ret;
+        for(; i*PAGE_SIZE < ret && idx < dev->nPages; i++, idx++)
+        {
+            u8 *src = dev->snapBuf + i*PAGE_SIZE;
+            size_t len = min_t(size_t, PAGE_SIZE, ret - i*PAGE_SIZE);
+            u8 *mem;
+            if( !memchr_inv(src, 0, len) )
+                continue;
+            dev->pages[idx] = alloc_page(GFP_KERNEL | __GFP_ZERO | __GFP_HIGHMEM);
+            if( !dev->pages[idx] )
+                return -ENOMEM;
+            mem = kmap_atomic(dev->pages[idx]);
+            memcpy(mem, src, len);
+            kunmap_atomic(mem);
+        }
+        if(ret < EMBB_GPIO_SNAP_BATCH*PAGE_SIZE)
+            break;              //end of file
+    }
+    return 0;
+}
+
+static int embbGpioSnapInit(EmbbGpioDev *dev)
+{
+    int err = 0;
+    INIT_WORK(&dev->snapWork, embbGpioSnapWork);
+    if( !backing_file )
+        return 0;
+    dev->backing = filp_open(backing_file, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if( IS_ERR(dev->backing) )
+    {
+        err = PTR_ERR(dev->backing);
+        goto fail_open;
+    }
+    dev->snapBuf = vmalloc(EMBB_GPIO_SNAP_BATCH*PAGE_SIZE);
+    dev->dirty = kvzalloc(BITS_TO_LONGS(dev->nPages)*sizeof(long), GFP_KERNEL);
+    if( !dev->snapBuf || !dev->dirty )
+    {
+        err = -ENOMEM;
+        goto fail_alloc;
+    }
+    err = embbGpioRestore(dev);
+    if(err)
+        goto fail_alloc;
+    return 0;
+fail_alloc:
+    kvfree(dev->dirty);
+    dev->dirty = NULL;
+    vfree(dev->snapBuf);
+    filp_close(dev->backing, NULL);
+fail_open:
+    dev->backing = NULL;
+    printk(KERN_WARNING "backing file %s unusable: %d\n", backing_file, err);
+    return err;
+}
+
+/* Before suspend or hibernation the queue is frozen for a moment and a
+ * snapshot taken, so the backing file holds a consistent image should the
+ * system not come back. Writes after that are snapshotted next time. */
+static int embbGpioPmNotify(struct notifier_block *nb, unsigned long action,
+        void *data)
+{
+    EmbbGpioDev *dev = container_of(nb, EmbbGpioDev, pmNb);
+    if( action != PM_SUSPEND_PREPARE && action != PM_HIBERNATION_PREPARE )
+        return NOTIFY_DONE;
+    blk_mq_freeze_queue(dev->rq);
+    /* through the work item, never called directly: a snapshot ioctl may
+     * queue it any time and two runs would share snapBuf and the bitmap */
+    schedule_work(&dev->snapWork);
+    flush_work(&dev->snapWork);
+    blk_mq_unfreeze_queue(dev->rq);
+    if(dev->snapErr)
+        printk(KERN_WARNING "snapshot before sleep failed: %d\n", dev->snapErr);
+    //a failed snapshot does not veto the sleep, the RAM copy is still valid
+    return NOTIFY_OK;
+}
+
+/* Last snapshot on unload, nothing may write the disk any more */
+static void embbGpioSnapExit(EmbbGpioDev *dev)
+{
+    if( !dev->backing )
+        return;
+    schedule_work(&dev->snapWork);
+    flush_work(&dev->snapWork);
+    filp_close(dev->backing, NULL);
+    dev->backing = NULL;
+    kvfree(dev->dirty);
+    dev->dirty = NULL;
+    vfree(dev->snapBuf);
+}
+
+static blk_status_t embbGpioXfer(EmbbGpioDev *dev, struct request *req)
+{
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    sector_t sector = blk_rq_pos(req);
+    blk_status_t ret = BLK_STS_OK;
+    if( sector + blk_rq_sectors(req) > get_capacity(dev->gd) )
+        return BLK_STS_IOERR;
+    switch( req_op(req) )
+    {
+        case REQ_OP_DISCARD:
+        case REQ_OP_WRITE_ZEROES:
+            embbGpioDiscard(dev, sector, blk_rq_sectors(req));
+            break;
+        case REQ_OP_READ:
+        case REQ_OP_WRITE:
+            rq_for_each_segment(bvec, req, iter)
+            {
+                u8 *buf = kmap_atomic(bvec.bv_page);
+                ret = embbGpioCopy(dev, sector, buf + bvec.bv_offset,
+                        bvec.bv_len, op_is_write(req_op(req)));
+                kunmap_atomic(buf);
+                if(ret)
+                    break;
+                sector += bvec.bv_len >> SECTOR_SHIFT_512;
+            }
+            break;
+        default:
+            ret = BLK_STS_NOTSUPP;
+            break;
+    }
+    return ret;
+}
+
+static blk_status_t embbGpioQueueRq(struct blk_mq_hw_ctx *hctx,
+        const struct blk_mq_queue_data *bd)
+{   /* Handler for queued requests, runs on the submitting CPU */
+    EmbbGpioDev *dev = hctx->queue->queuedata;
+    struct request *req = bd->rq;
+    blk_status_t ret;
+    blk_mq_start_request(req);
+    ret = embbGpioXfer(dev, req);
+    //out of pages: let blk-mq retry later, the copy is idempotent
+    if( ret == BLK_STS_RESOURCE )
+        return ret;
+    /* Memory copy is done, complete right here instead of bouncing through
+     * an IPI or softirq to another CPU */
+    blk_mq_end_request(req, ret);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops embbGpioMqOps = {
+    .queue_rq = embbGpioQueueRq,
+};
+
 static int embbGpioOpen(struct inode *inode, struct file *filp)
 {
     printk(KERN_WARNING "DEVICE OPENED\n");
@@ -85,9 +482,10 @@ static int embbGpioRelease(struct inode *inode, struct file *filp)
 /* A higher-level block subsystem intercepts also ioctl requests.
  * @dataPtr is optional, points to user space
  */
-static int embbGpioIoctl(struct inode *inode, struct file *filp,
+static int embbGpioIoctl(struct block_device *bdev, fmode_t mode,
         unsigned int cmd, unsigned long dataPtr)
 {
+    EmbbGpioDev *dev = bdev->bd_disk->private_data;
     int ret=0;
     //simple security checks
     if( (_IOC_TYPE(cmd) != EMBB_GPIO_MAGIC)||(_IOC_NR(cmd) > EMBB_GPIO_MAXNR) )
@@ -107,6 +505,21 @@ static int embbGpioIoctl(struct inode *inode, struct file *filp,
         case EMBB_GPIO_TEST:
             printk(KERN_WARNING "IOCTL TEST\n");
             break;
+        case EMBB_GPIO_SNAPSHOT:
+            if( !dev->backing )
+                ret = -ENODEV;
+            else
+                schedule_work(&dev->snapWork);
+            break;
+        case EMBB_GPIO_SNAPSHOT_WAIT:
+            if( !dev->backing )
+                ret = -ENODEV;
+            else
+            {
+                flush_work(&dev->snapWork);
+                ret = dev->snapErr;
+            }
+            break;
         //case EMBB_GPIO_GET_FIFO_TH:
         //    ret = 888;
         //    if( copy_to_user(arg, &ret, sizeof(ret)) )
@@ -133,6 +546,38 @@ out:
     return ret;
 }
 
+static int embbGpioCheckParams(void)
+{
+    if( !physical_bs )
+        physical_bs = logical_bs;
+    if( logical_bs < KERNEL_SECTOR_SIZE || logical_bs > PAGE_SIZE ||
+            !is_power_of_2(logical_bs) )
+        return -EINVAL;
+    if( physical_bs < logical_bs || !is_power_of_2(physical_bs) )
+        return -EINVAL;
+    if( io_opt % physical_bs || max_sectors < PAGE_SECTORS || !nsectors )
+        return -EINVAL;
+    return 0;
+}
+
+/* A RAM disk has no DMA constraints: one request may carry any number of
+ * segments, so the only limit that matters is max_sectors. Everything else
+ * follows the module parameters.
+ */
+static void embbGpioSetLimits(struct request_queue *rq)
+{
+    blk_queue_logical_block_size(rq, logical_bs);
+    blk_queue_physical_block_size(rq, physical_bs);
+    blk_queue_io_min(rq, physical_bs);
+    if(io_opt)
+        blk_queue_io_opt(rq, io_opt);
+    blk_queue_max_hw_sectors(rq, max_sectors);
+    blk_queue_max_segments(rq, USHRT_MAX);
+    blk_queue_max_segment_size(rq, UINT_MAX);
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, rq);
+    blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, rq);
+}
+
 static struct block_device_operations embbGpioOps = {
     .owner   = THIS_MODULE,
     .open    = embbGpioOpen,
@@ -143,34 +588,74 @@ static struct block_device_operations embbGpioOps = {
 static int __init embbGpioInit(void)
 {
     printk(KERN_WARNING "%s\n", __TIME__);
-    int err=0, err_flag=0;
+    int err=0, err_flag=0, major=0;
+    err = embbGpioCheckParams();
+    if(err)
+    {
+        printk(KERN_WARNING "invalid block size parameters\n");
+        return err;
+    }
     /* Allocate the wrapper structure, pointer has to be global */
     devPtr = (EmbbGpioDev *) kzalloc( sizeof( struct EmbbGpioDev), GFP_KERNEL );
     if(!devPtr)
+    {
+        err = -ENOMEM;
         goto fail_kzalloc;
+    }
     /* Parameters setup */
     devPtr->minorsNb=1;
-    devPtr->hardSect = 512;
-    devPtr->nSectors = EMBB_GPIO_NSECTORS;          // one packet is 4096 -> 64*512 is 8 packets
+    devPtr->hardSect = logical_bs;
+    devPtr->nSectors = nsectors;            // one packet is 4096 -> 64*512 is 8 packets
     devPtr->size = devPtr->nSectors*devPtr->hardSect;       //for the kernel a disk is just a linear 512-bytes array
     /* Register the device and choose dynamically major number (0) */
-    err = register_blkdev(0, EMBB_GPIO_DEV_NAME);
-    if(err<0)
+    major = register_blkdev(0, EMBB_GPIO_DEV_NAME);
+    if(major<0)
+    {
+        err = major;
         goto fail_register;
-    devPtr->major = err;
-    devPtr->data = vmalloc(devPtr->size);
-    if( !devPtr->data )
+    }
+    devPtr->major = major;
+    devPtr->nPages = DIV_ROUND_UP(devPtr->size, PAGE_SIZE);
+    devPtr->pages = vzalloc(devPtr->nPages * sizeof(struct page *));
+    if( !devPtr->pages )
+    {
+        err = -ENOMEM;
         goto fail_vmalloc;
-    /* Prepare a request queue for a block device, args: handler + spin lock */
-    spin_lock_init(&devPtr->rqLock);
-    devPtr->rq = blk_init_queue( embbGpioReqHandler, &devPtr->rqLock);
-    if ( !devPtr->rq )
+    }
+    err = embbGpioSnapInit(devPtr);
+    if(err)
+        goto fail_snap_init;
+    /* Prepare a multi-queue tag set, one hardware queue per CPU, the default
+     * mapping then ties every CPU to its own queue */
+    devPtr->tagSet.ops = &embbGpioMqOps;
+    devPtr->tagSet.nr_hw_queues = nr_cpu_ids;
+    devPtr->tagSet.queue_depth = queue_depth;
+    devPtr->tagSet.numa_node = NUMA_NO_NODE;
+    devPtr->tagSet.flags = BLK_MQ_F_SHOULD_MERGE;
+    devPtr->tagSet.driver_data = devPtr;
+    err = blk_mq_alloc_tag_set(&devPtr->tagSet);
+    if(err)
+        goto fail_tag_set;
+    devPtr->rq = blk_mq_init_queue(&devPtr->tagSet);
+    if ( IS_ERR(devPtr->rq) )
+    {
+        err = PTR_ERR(devPtr->rq);
         goto fail_init_queue;
+    }
     devPtr->rq->queuedata = devPtr;             //TODO: this is perhaps passed as an opaque
+    embbGpioSetLimits(devPtr->rq);
+    /* Advertise discard/write-zeroes so that fstrim gives pages back */
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, devPtr->rq);
+    devPtr->rq->limits.discard_granularity = PAGE_SIZE;
+    blk_queue_max_discard_sectors(devPtr->rq, UINT_MAX >> SECTOR_SHIFT_512);
+    blk_queue_max_write_zeroes_sectors(devPtr->rq, UINT_MAX >> SECTOR_SHIFT_512);
     /* Gendisk structure allocation and setup */
     devPtr->gd = alloc_disk(devPtr->minorsNb);
     if( !devPtr->gd )
+    {
+        err = -ENOMEM;
         goto fail_alloc_disk;
+    }
     devPtr->gd->major = devPtr->major;
     devPtr->gd->first_minor = 1;
     devPtr->gd->fops = &embbGpioOps;
@@ -181,6 +666,11 @@ static int __init embbGpioInit(void)
     devPtr->gd->private_data = devPtr;
     /* Only when everything is set up */
     add_disk(devPtr->gd);
+    if(devPtr->backing)
+    {
+        devPtr->pmNb.notifier_call = embbGpioPmNotify;
+        register_pm_notifier(&devPtr->pmNb);
+    }
     printk(KERN_WARNING "INIT SUCCESS\n");
     return 0;
     /* Failures */
@@ -189,8 +679,16 @@ fail_alloc_disk:
         printk( KERN_WARNING "alloc disk failed\n");
     blk_cleanup_queue(devPtr->rq);
 fail_init_queue:
-    if(!err_flag);
+    if(!err_flag++)
         printk( KERN_WARNING "queue init failed\n");
+    blk_mq_free_tag_set(&devPtr->tagSet);
+fail_tag_set:
+    if(!err_flag++)
+        printk( KERN_WARNING "tag set allocation failed\n");
+    embbGpioSnapExit(devPtr);
+fail_snap_init:
+    err_flag++;                 //reported by embbGpioSnapInit()
+    embbGpioFreePages(devPtr);
 fail_vmalloc:
     if(!err_flag++)
         printk( KERN_WARNING "vmalloc failed\n");
@@ -208,9 +706,14 @@ fail_kzalloc:
 
 static void __exit embbGpioExit(void)
 {
+    if(devPtr->backing)
+        unregister_pm_notifier(&devPtr->pmNb);
     del_gendisk(devPtr->gd);
-    vfree(devPtr->data);
+    //the last snapshot still freezes the queue
+    embbGpioSnapExit(devPtr);
     blk_cleanup_queue(devPtr->rq);
+    blk_mq_free_tag_set(&devPtr->tagSet);
+    embbGpioFreePages(devPtr);
     unregister_blkdev(devPtr->major, EMBB_GPIO_DEV_NAME);
     kfree(devPtr);
     devPtr=NULL;
@@ -0,0 +1,211 @@
+#ifndef EMBB_RING_H
+#define EMBB_RING_H
+/* Ring buffer shared by the drivers and by the hello.ko benchmark.
+ * - one producer and one consumer run without locks (SPSC); several
+ *   producers go through the _mp calls, which serialise on plock (MPSC),
+ * - head and tail live on separate cache lines, each side also keeps a copy
+ *   of the other side's index and only reloads it when the copy says the
+ *   ring is full/empty, so in the common case a side touches its own line,
+ * - indices run free, the size is a power of 2,
+ * - bulk in/out copy, peek/commit and reserve/publish hand out the
+ *   contiguous part in place, records are a u16 length plus payload and are
+ *   queued whole or not at all.
+ * Header only: every module gets its own copy, nothing to export.
+ */
+#include <linux/types.h>
+#include <linux/kernel.h>           //min()
+#include <linux/cache.h>            //____cacheline_aligned_in_smp
+#include <linux/compiler.h>         //READ_ONCE
+#include <linux/log2.h>             //is_power_of_2
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <asm/barrier.h>            //smp_load_acquire, smp_store_release
+
+struct embb_ring
+{
+    //producer side
+    unsigned int head ____cacheline_aligned_in_smp;
+    unsigned int tail_cache;        //tail as last seen by the producer
+    spinlock_t plock;               //_mp producers
+    //consumer side
+    unsigned int tail ____cacheline_aligned_in_smp;
+    unsigned int head_cache;        //head as last seen by the consumer
+    //read-only after init
+    u8 *buf ____cacheline_aligned_in_smp;
+    unsigned int mask;
+};
+
+static inline int embb_ring_init(struct embb_ring *r, unsigned int size,
+        gfp_t gfp)
+{
+    if( !is_power_of_2(size) )
+        return -EINVAL;
+    r->buf = kmalloc(size, gfp);
+    if( !r->buf )
+        return -ENOMEM;
+    r->mask = size - 1;
+    r->head = r->tail = r->tail_cache = r->head_cache = 0;
+    spin_lock_init(&r->plock);
+    return 0;
+}
+
+static inline void embb_ring_free(struct embb_ring *r)
+{
+    kfree(r->buf);
+    r->buf = NULL;
+}
+
+static inline unsigned int embb_ring_size(const struct embb_ring *r)
+{
+    return r->mask + 1;
+}
+
+/* Both sides have to be stopped */
+static inline void embb_ring_reset(struct embb_ring *r)
+{
+    r->head = r->tail = r->tail_cache = r->head_cache = 0;
+}
+
+/* From anywhere, a snapshot that may be stale by the time it is used */
+static inline unsigned int embb_ring_len(const struct embb_ring *r)
+{
+    return READ_ONCE(r->head) - READ_ONCE(r->tail);
+}
+
+static inline bool embb_ring_empty(const struct embb_ring *r)
+{
+    return !embb_ring_len(r);
+}
+
+/* PRODUCER */
+
+/* Free space, the tail is only reloaded when the copy shows less than @want */
+static inline unsigned int embb_ring_avail(struct embb_ring *r,
+        unsigned int want)
+{
+    unsigned int free = embb_ring_size(r) - (r->head - r->tail_cache);
+    if(free < want)
+    {
+        //the consumer is done with the bytes before tail
+        r->tail_cache = smp_load_acquire(&r->tail);
+        free = embb_ring_size(r) - (r->head - r->tail_cache);
+    }
+    return free;
+}
+
+/* Copies @n bytes at @pos without publishing them */
+static inline void __embb_ring_copy_in(struct embb_ring *r, unsigned int pos,
+        const void *src, unsigned int n)
+{
+    unsigned int off = pos & r->mask;
+    unsigned int first = min(n, embb_ring_size(r) - off);
+    memcpy(r->buf + off, src, first);
+    memcpy(r->buf, (const u8 *)src + first, n - first);
+}
+
+static inline void embb_ring_publish(struct embb_ring *r, unsigned int n)
+{
+    //data before the index that makes it visible
+    smp_store_release(&r->head, r->head + n);
+}
+
+/* Contiguous free area at the head, fill it and publish() what was used */
+static inline unsigned int embb_ring_reserve(struct embb_ring *r, void **p)
+{
+    unsigned int off = r->head & r->mask;
+    unsigned int contig = embb_ring_size(r) - off;
+    *p = r->buf + off;
+    return min(embb_ring_avail(r, contig), contig);
+}
+
+/* Bulk in, as much of @n as fits */
+static inline unsigned int embb_ring_in(struct embb_ring *r, const void *src,
+        unsigned int n)
+{
+    n = min(n, embb_ring_avail(r, n));
+    __embb_ring_copy_in(r, r->head, src, n);
+    embb_ring_publish(r, n);
+    return n;
+}
+
+/* One record, false when it does not fit whole */
+static inline bool embb_ring_put_rec(struct embb_ring *r, const void *src,
+        u16 len)
+{
+    unsigned int need = sizeof(len) + len;
+    if( embb_ring_avail(r, need) < need )
+        return false;
+    __embb_ring_copy_in(r, r->head, &len, sizeof(len));
+    __embb_ring_copy_in(r, r->head + sizeof(len), src, len);
+    embb_ring_publish(r, need);
+    return true;
+}
+
+static inline unsigned int embb_ring_in_mp(struct embb_ring *r,
+        const void *src, unsigned int n)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&r->plock, flags);
+    n = embb_ring_in(r, src, n);
+    spin_unlock_irqrestore(&r->plock, flags);
+    return n;
+}
+
+/* CONSUMER */
+
+/* Queued bytes, the head is only reloaded when the copy shows less than @want */
+static inline unsigned int embb_ring_used(struct embb_ring *r,
+        unsigned int want)
+{
+    unsigned int used = r->head_cache - r->tail;
+    if(used < want)
+    {
+        //the producer's data is written before the head that shows it
+        r->head_cache = smp_load_acquire(&r->head);
+        used = r->head_cache - r->tail;
+    }
+    return used;
+}
+
+/* Contiguous queued data at the tail, commit() what was consumed */
+static inline unsigned int embb_ring_peek(struct embb_ring *r, void **p)
+{
+    unsigned int off = r->tail & r->mask;
+    unsigned int contig = embb_ring_size(r) - off;
+    *p = r->buf + off;
+    return min(embb_ring_used(r, contig), contig);
+}
+
+static inline void embb_ring_commit(struct embb_ring *r, unsigned int n)
+{
+    //done reading before the producer may reuse the space
+    smp_store_release(&r->tail, r->tail + n);
+}
+
+/* Bulk out, up to @n bytes */
+static inline unsigned int embb_ring_out(struct embb_ring *r, void *dst,
+        unsigned int n)
+{
+    unsigned int off = r->tail & r->mask, first;
+    n = min(n, embb_ring_used(r, n));
+    first = min(n, embb_ring_size(r) - off);
+    memcpy(dst, r->buf + off, first);
+    memcpy((u8 *)dst + first, r->buf, n - first);
+    embb_ring_commit(r, n);
+    return n;
+}
+
+/* Length of the next record, which stays queued; -1 if there is none */
+static inline int embb_ring_rec_len(struct embb_ring *r)
+{
+    unsigned int off = r->tail & r->mask;
+    u16 len;
+    if( embb_ring_used(r, sizeof(len)) < sizeof(len) )
+        return -1;
+    ((u8 *)&len)[0] = r->buf[off];
+    ((u8 *)&len)[1] = r->buf[(off + 1) & r->mask];
+    return len;
+}
+
+#endif //EMBB_RING_H
@@ -1,48 +1,245 @@
-/* This is an old method of initializing module but should work */
+/* kfifo vs embb_ring microbenchmark, runs once at load time:
+ *  insmod hello.ko items=1048576 ring_sz=4096
+ *  dmesg | grep bench
+ * For both buffers ns per int moved is printed for:
+ * - elem: one int per in/out call, bulk: BENCH_BULK ints per call,
+ * - alone: one thread fills and drains in turns, the buffer stays in cache,
+ * - spsc: producer and consumer kthreads on two CPUs,
+ * - mpsc: two producers on two CPUs (kfifo_in_spinlocked and
+ *   embb_ring_in_mp) and one consumer on a third.
+ * The contended cases need 2 resp. 3 online CPUs and are skipped otherwise.
+ */
 
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/utsname.h>
 #include <linux/moduleparam.h>
 #include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/cpumask.h>
+#include "embb_ring.h"
+
+#define BENCH_BULK 64               //ints per call in the bulk runs
 
 /* parameters passed during loading module */
-static char *arg_str = "<empty>";
-static uint arg_val = 0xdeadbeef;
-//DEFINE_KFIFO(fifo, int, 8);
+static ulong items = 1 << 20;
+static uint ring_sz = 4096;
+
+module_param(items, ulong, S_IRUGO);
+MODULE_PARM_DESC(items, "ints moved per run");
+module_param(ring_sz, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_sz, "buffer size in bytes, power of 2");
+
 static struct kfifo fifo;
+static DEFINE_SPINLOCK(fifo_plock);
+static struct embb_ring ring;
+
+/* The buffer under test, n and the return values in bytes */
+struct bench_buf
+{
+    const char *name;
+    unsigned int (*in)(const void *src, unsigned int n);
+    unsigned int (*in_mp)(const void *src, unsigned int n);
+    unsigned int (*out)(void *dst, unsigned int n);
+};
+
+static unsigned int fifo_in(const void *src, unsigned int n)
+{
+    return kfifo_in(&fifo, src, n);
+}
+
+static unsigned int fifo_in_mp(const void *src, unsigned int n)
+{
+    return kfifo_in_spinlocked(&fifo, src, n, &fifo_plock);
+}
+
+static unsigned int fifo_out(void *dst, unsigned int n)
+{
+    return kfifo_out(&fifo, dst, n);
+}
+
+static unsigned int ring_in(const void *src, unsigned int n)
+{
+    return embb_ring_in(&ring, src, n);
+}
+
+static unsigned int ring_in_mp(const void *src, unsigned int n)
+{
+    return embb_ring_in_mp(&ring, src, n);
+}
+
+static unsigned int ring_out(void *dst, unsigned int n)
+{
+    return embb_ring_out(&ring, dst, n);
+}
 
-module_param(arg_str, charp, S_IRUGO);
-module_param(arg_val, uint, S_IRUGO);
+static const struct bench_buf bufs[] = {
+    { "kfifo", fifo_in, fifo_in_mp, fifo_out },
+    { "embb_ring", ring_in, ring_in_mp, ring_out },
+};
+
+struct bench_run
+{
+    const struct bench_buf *b;
+    unsigned int chunk;             //bytes per call
+    unsigned long bytes;            //per producer
+    bool mp;
+    struct completion done;
+};
+
+enum bench_dir { BENCH_IN, BENCH_IN_MP, BENCH_OUT };
+
+/* Moves @bytes in @chunk calls, spinning while it makes no progress; the
+ * data itself does not matter */
+static void bench_move(const struct bench_buf *b, enum bench_dir dir,
+        unsigned int chunk, unsigned long bytes)
+{
+    int tab[BENCH_BULK] = {0};
+    unsigned long done = 0;
+    while(done < bytes)
+    {
+        unsigned int n = min_t(unsigned long, chunk, bytes - done);
+        switch(dir)
+        {
+            case BENCH_IN: n = b->in(tab, n); break;
+            case BENCH_IN_MP: n = b->in_mp(tab, n); break;
+            default: n = b->out(tab, n); break;
+        }
+        if(!n)
+            cpu_relax();
+        done += n;
+    }
+}
+
+static int bench_producer(void *arg)
+{
+    struct bench_run *run = arg;
+    bench_move(run->b, run->mp ? BENCH_IN_MP : BENCH_IN, run->chunk,
+            run->bytes);
+    complete(&run->done);
+    return 0;
+}
+
+static int bench_consumer(void *arg)
+{
+    struct bench_run *run = arg;
+    bench_move(run->b, BENCH_OUT, run->chunk,
+            run->bytes * (run->mp ? 2 : 1));
+    complete(&run->done);
+    return 0;
+}
+
+static void bench_reset(void)
+{
+    kfifo_reset(&fifo);
+    embb_ring_reset(&ring);
+}
+
+/* One thread, fill a chunk then drain it */
+static u64 bench_alone(const struct bench_buf *b, unsigned int chunk)
+{
+    int tab[BENCH_BULK];
+    unsigned long bytes = items * sizeof(int), done = 0;
+    u64 t0 = ktime_get_ns();
+    for(; done < bytes; done += chunk)
+    {
+        b->in(tab, chunk);
+        b->out(tab, chunk);
+    }
+    return ktime_get_ns() - t0;
+}
+
+/* Producer(s) and consumer on their own CPUs, -1 if there are not enough */
+static s64 bench_threads(const struct bench_buf *b, unsigned int chunk,
+        bool mp)
+{
+    struct bench_run run = {
+        .b = b, .chunk = chunk, .mp = mp,
+        .bytes = items * sizeof(int) / (mp ? 2 : 1),
+    };
+    struct task_struct *t[3];
+    int nt = mp ? 3 : 2, i = 0, cpu = -1;
+    u64 t0;
+    if(num_online_cpus() < nt)
+        return -1;
+    init_completion(&run.done);
+    for(; i < nt; i++)
+    {
+        t[i] = kthread_create(i ? bench_producer : bench_consumer, &run,
+                "bench/%d", i);
+        if( IS_ERR(t[i]) )
+        {
+            //not started yet, so they can still be stopped
+            while(i--)
+                kthread_stop(t[i]);
+            return -1;
+        }
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        kthread_bind(t[i], cpu);
+    }
+    t0 = ktime_get_ns();
+    for(i = 0; i < nt; i++)
+        wake_up_process(t[i]);
+    for(i = 0; i < nt; i++)
+        wait_for_completion(&run.done);
+    return ktime_get_ns() - t0;
+}
+
+static void bench_print(const char *buf, const char *mode, const char *ctx,
+        s64 ns)
+{
+    if(ns < 0)
+        printk(KERN_ALERT "bench %-9s %-4s %-5s skipped\n", buf, mode, ctx);
+    else
+        printk(KERN_ALERT "bench %-9s %-4s %-5s %llu.%02llu ns/int\n", buf,
+                mode, ctx, div64_u64(ns, items),
+                div64_u64(100 * ns, items) % 100);
+}
 
 static int __init hello_init(void)
 {
+    int err = 0;
+    size_t i = 0, m = 0;
     printk(KERN_ALERT "Hello ARM world, kernel: %s\n", utsname()->release );
-    printk(KERN_ALERT "Params: \n\t%s\n\t%08x\n", arg_str, arg_val );
-    int tab[]={-3,-2,-1,0,20,128};
-    kfifo_alloc(&fifo, 8*sizeof(int), GFP_KERNEL);
-    size_t i=0;
-    for(i=0; i<6; i++)
+    printk(KERN_ALERT "bench: %lu ints, %u byte buffers, %u CPUs\n", items,
+            ring_sz, num_online_cpus());
+    if( !items || !is_power_of_2(ring_sz) || ring_sz < BENCH_BULK*sizeof(int) )
+        return -EINVAL;
+    err = kfifo_alloc(&fifo, ring_sz, GFP_KERNEL);
+    if(err)
+        return err;
+    err = embb_ring_init(&ring, ring_sz, GFP_KERNEL);
+    if(err)
     {
-        kfifo_in(&fifo,tab+i, sizeof(int));
-        printk(KERN_ALERT "put: %d\n",tab[i]);
+        kfifo_free(&fifo);
+        return err;
+    }
+    for(i = 0; i < ARRAY_SIZE(bufs); i++)
+    {
+        for(m = 0; m < 2; m++)
+        {
+            unsigned int chunk = m ? BENCH_BULK*sizeof(int) : sizeof(int);
+            const char *mode = m ? "bulk" : "elem";
+            bench_reset();
+            bench_print(bufs[i].name, mode, "alone", bench_alone(bufs+i, chunk));
+            bench_reset();
+            bench_print(bufs[i].name, mode, "spsc",
+                    bench_threads(bufs+i, chunk, false));
+            bench_reset();
+            bench_print(bufs[i].name, mode, "mpsc",
+                    bench_threads(bufs+i, chunk, true));
+        }
     }
-    printk(KERN_ALERT "fifo sz: %d\n",kfifo_size(&fifo));
     return 0;
 }
 
 static void __exit goodbye_init(void)
 {
-    size_t i=0;
-    for(i=0; i<6; i++)
-    {
-        int tmp=888;
-        kfifo_out(&fifo, &tmp,sizeof(tmp));
-        printk(KERN_ALERT "val: %d\n",(int)tmp);
-    }
+    embb_ring_free(&ring);
     kfifo_free(&fifo);
     printk(KERN_ALERT "Goodbye ARM world\n");
-    printk(KERN_ALERT "Params: \n\t%s\n\t%08x\n", arg_str, arg_val );
 }
 
 module_init(hello_init);
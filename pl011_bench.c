@@ -0,0 +1,311 @@
+/* Loopback benchmark for the pl011_uart variants (v1: irq_pending flag, v2:
+ * tasklet + kfifo, v3 and current: workqueue + kfifo). The module under test
+ * has to be loaded with loopback=1 so that every byte written comes back on
+ * RX, either from QEMU's PL011 or from pl011_model.ko (load it with burst=0).
+ *
+ * Two phases:
+ * - throughput: one thread writes a 1..255 counter pattern for -t seconds,
+ *   another reads it back; bytes/s counts the pattern bytes received, a gap in
+ *   the sequence counts as dropped bytes. 0x00 is never sent, v2/v3 pad
+ *   words with NULs and those are skipped,
+ * - latency: -l ping-pongs of one byte, write -> read back, so IRQ -> bottom
+ *   half -> wakeup -> read plus one character time on the line.
+ * CPU usage is system-wide from /proc/stat, the bottom halves run in kworkers
+ * and softirqs and would not show up in our own rusage.
+ *
+ * -d may also point at the tty front end (pl011_uart.ko tty=1, /dev/ttyPL0),
+ * the port is switched to raw mode first so the two paths compare like for
+ * like; the difference is the line discipline and flip buffer overhead.
+ *
+ * -b us turns on the driver's busy polling for the latency phase, compare
+ * the percentiles with and without it.
+ * -U n sends n urgent NULs (PL011_TX_URGENT, 10 ms apart) while the
+ * throughput phase saturates TX and prints how long each took to come back
+ * as: urgent n p50_us p99_us max_us, on stderr. Current driver only, the
+ * older variants neither have the lane nor keep NULs apart from padding.
+ * -S len skips both phases and runs the driver's PL011_SELFTEST instead: a
+ * PRBS15 stream of len bytes through CR.LBE, checked in the driver, printed
+ * as: variant bytes_s bit_errors dropped.
+ *
+ * Output is one tab-separated line per run, -H prints the header:
+ *   variant bytes_s lat_p50_us lat_p90_us lat_p99_us lat_max_us cpu_pct dropped
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "pl011_uart.h"
+
+#define DEVPATH "/dev/pl011_uart0"
+#define RBUFF_SZ 4096
+
+static int rfd = -1, wfd = -1;     //reader and writer never share a file offset
+static volatile int stop = 0;
+static unsigned long long rx_bytes = 0, dropped = 0;
+static size_t chunk = 8;
+static size_t nurg = 0, urg_got = 0;
+static uint64_t *urg_lat = NULL;
+static volatile uint64_t urg_t0 = 0;        //0: no urgent byte in flight
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* busy and total jiffies of all CPUs */
+static void cpu_sample(unsigned long long *busy, unsigned long long *total)
+{
+    unsigned long long v[8] = {0};
+    FILE *f = fopen("/proc/stat", "r");
+    if(!f || fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+            v, v+1, v+2, v+3, v+4, v+5, v+6, v+7) != 8)
+    {
+        perror("/proc/stat");
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    *total = v[0]+v[1]+v[2]+v[3]+v[4]+v[5]+v[6]+v[7];
+    *busy = *total - v[3] - v[4];       //minus idle and iowait
+}
+
+static void on_signal(int sig)
+{
+    //only there to make blocking read() return EINTR
+}
+
+static void *writer(void *arg)
+{
+    unsigned char buf[256];
+    size_t i = 0, pos = 0;
+    for(; i < sizeof(buf); i++)
+        buf[i] = i % 255 + 1;
+    while(!stop)
+    {
+        ssize_t ret = write(wfd, buf + pos, chunk < 255 - pos ? chunk : 255 - pos);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        //0 would spin here forever, no driver has a reason to return it
+        if(ret <= 0)
+        {
+            if(!ret)
+                errno = EIO;
+            perror("write");
+            break;
+        }
+        pos = (pos + ret) % 255;
+    }
+    return NULL;
+}
+
+static void *urgent(void *arg)
+{
+    struct pl011_tx_urgent u;
+    size_t i = 0;
+    memset(&u, 0, sizeof(u));
+    u.len = 1;
+    for(; i < nurg && !stop; i++)
+    {
+        urg_t0 = now_ns();
+        if( ioctl(wfd, PL011_TX_URGENT, &u) < 0 )
+        {
+            perror("PL011_TX_URGENT");
+            break;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    unsigned char buf[RBUFF_SZ];
+    unsigned char expect = 1;
+    while(!stop)
+    {
+        ssize_t ret = read(rfd, buf, sizeof(buf)), i = 0;
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("read");
+            break;
+        }
+        for(; i < ret; i++)
+        {
+            if(!buf[i])
+            {
+                if(urg_t0 && urg_got < nurg)
+                    urg_lat[urg_got++] = now_ns() - urg_t0;
+                urg_t0 = 0;
+                continue;
+            }
+            if(buf[i] != expect)
+                dropped += (buf[i] + 255 - expect) % 255;
+            expect = buf[i] % 255 + 1;
+            rx_bytes++;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Ping-pong of one byte, a probe lost for a second counts as dropped */
+static size_t latency(uint64_t *lat, size_t n)
+{
+    size_t i = 0, got = 0;
+    for(; i < n; i++)
+    {
+        unsigned char c = i % 255 + 1, r = 0;
+        uint64_t t0 = now_ns();
+        if(write(wfd, &c, 1) != 1)
+            break;
+        alarm(1);
+        while(r != c)
+            if(read(rfd, &r, 1) < 0)
+                break;
+        alarm(0);
+        if(r != c)
+        {
+            dropped++;
+            continue;
+        }
+        lat[got++] = now_ns() - t0;
+    }
+    qsort(lat, got, sizeof(*lat), cmp_u64);
+    return got;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = DEVPATH, *name = "pl011_uart";
+    int secs = 5, opt;
+    size_t nlat = 1000;
+    unsigned long selftest = 0;
+    unsigned int busy_us = 0;
+    while( (opt = getopt(argc, argv, "d:n:t:l:s:S:b:U:H")) != -1 )
+    {
+        switch(opt)
+        {
+            case 'd': path = optarg; break;
+            case 'n': name = optarg; break;
+            case 't': secs = atoi(optarg); break;
+            case 'l': nlat = strtoul(optarg, NULL, 0); break;
+            case 's': chunk = strtoul(optarg, NULL, 0); break;
+            case 'S': selftest = strtoul(optarg, NULL, 0); break;
+            case 'b': busy_us = strtoul(optarg, NULL, 0); break;
+            case 'U': nurg = strtoul(optarg, NULL, 0); break;
+            case 'H':
+                printf("variant\tbytes_s\tlat_p50_us\tlat_p90_us\tlat_p99_us"
+                        "\tlat_max_us\tcpu_pct\tdropped\n");
+                return 0;
+            default:
+                fprintf(stderr, "usage: %s [-d dev] [-n name] [-t secs]"
+                        " [-l probes] [-s write_sz] [-S selftest_len]"
+                        " [-b busy_us] [-U urgent] [-H]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;          //no SA_RESTART
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    //the self-test wants to be the only user of the port
+    wfd = open(path, selftest ? O_RDWR : O_WRONLY);
+    rfd = selftest ? wfd : open(path, O_RDONLY);
+    if(rfd<0 || wfd<0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    struct termios tio;
+    if( isatty(rfd) && !tcgetattr(rfd, &tio) )
+    {
+        cfmakeraw(&tio);
+        tio.c_cc[VMIN] = 1;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(rfd, TCSANOW, &tio);
+    }
+    if(selftest)
+    {
+        struct pl011_selftest st;
+        memset(&st, 0, sizeof(st));
+        st.len = selftest;
+        st.timeout_ms = 10000;
+        if( ioctl(wfd, PL011_SELFTEST, &st) < 0 )
+        {
+            perror("PL011_SELFTEST");
+            exit(EXIT_FAILURE);
+        }
+        printf("%s\t%.0f\t%llu\t%llu\n", name,
+                st.elapsed_ns ? st.rx_bytes*1e9/st.elapsed_ns : 0,
+                (unsigned long long)st.bit_errors,
+                (unsigned long long)st.dropped);
+        close(wfd);
+        return 0;
+    }
+    /* throughput */
+    pthread_t wr, rd, ur;
+    unsigned long long busy0, total0, busy1, total1;
+    cpu_sample(&busy0, &total0);
+    uint64_t t0 = now_ns();
+    pthread_create(&rd, NULL, reader, NULL);
+    pthread_create(&wr, NULL, writer, NULL);
+    if(nurg)
+    {
+        urg_lat = calloc(nurg, sizeof(*urg_lat));
+        pthread_create(&ur, NULL, urgent, NULL);
+    }
+    sleep(secs);
+    stop = 1;
+    if(nurg)
+        pthread_join(ur, NULL);
+    pthread_kill(wr, SIGUSR1);
+    pthread_join(wr, NULL);
+    usleep(100000);                     //let the last bytes come back
+    pthread_kill(rd, SIGUSR1);
+    pthread_join(rd, NULL);
+    double elapsed = (now_ns() - t0)*1e-9;
+    cpu_sample(&busy1, &total1);
+    double cpu = total1 > total0 ?
+        100.0*(busy1 - busy0)/(total1 - total0) : 0;
+    if(nurg)
+    {
+        qsort(urg_lat, urg_got, sizeof(*urg_lat), cmp_u64);
+        #define UPCT(p) (urg_got ? urg_lat[(urg_got-1)*(p)/100]/1000.0 : 0)
+        fprintf(stderr, "urgent\t%zu\t%.1f\t%.1f\t%.1f\n", urg_got,
+                UPCT(50), UPCT(99), UPCT(100));
+        free(urg_lat);
+    }
+    /* latency, nothing else in flight */
+    if( busy_us && ioctl(rfd, PL011_SET_BUSY_POLL, &busy_us) < 0 )
+        perror("PL011_SET_BUSY_POLL");
+    uint64_t *lat = calloc(nlat ? nlat : 1, sizeof(*lat));
+    size_t got = latency(lat, nlat);
+    #define PCT(p) (got ? lat[(got-1)*(p)/100]/1000.0 : 0)
+    printf("%s\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%llu\n", name,
+            rx_bytes/elapsed, PCT(50), PCT(90), PCT(99), PCT(100), cpu,
+            dropped);
+    free(lat);
+    close(rfd);
+    close(wfd);
+    return 0;
+}
@@ -0,0 +1,366 @@
+/* Software model of a PL011 UART, a register backend for pl011_uart.ko so
+ * its RX/TX path can be run and benchmarked without the silicon.
+ * MODEL:
+ * - DR, FR, LCR_H, CR, IMSC, RIS, MIS and ICR behave as on the PL011, both
+ *   FIFOs are 32 entries deep, RX interrupt at half full, RX timeout when a
+ *   tick passes without new characters, TX interrupt when the TX FIFO drains
+ *   down to half,
+ * - time is kept by an hrtimer tick, on each tick as many character slots
+ *   are played as fit in the elapsed time at @baud (10 bits per character),
+ * - in each slot the traffic generator may push one RX character (a running
+ *   counter, so the reader can check for losses) and the TX FIFO shifts one
+ *   character out; with CR.LBE set it comes back on RX instead,
+ * - the generator sends @burst characters back to back, then stays quiet for
+ *   @gap_us; burst=0 turns it off (loopback only),
+ * - the tick is also the interrupt line: the handler registered through
+ *   request_irq is called from it while (RIS & IMSC) != 0.
+ * Usage:
+ *  insmod pl011_model.ko baud=921600 burst=256 gap_us=500
+ *  insmod pl011_uart.ko use_model=1
+ *  counters: /sys/module/pl011_model/parameters/{rx_generated,rx_overrun,...}
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/interrupt.h>        //irq_handler_t
+#include "pl011_regs.h"
+
+#define MODEL_RX_LEVEL (PL011_FIFO_SZ/2)
+#define MODEL_TX_LEVEL (PL011_FIFO_SZ/2)
+#define MODEL_MAX_SLOTS 4096        //per tick, bounds catch-up after a stall
+
+typedef struct pl011_model
+{
+    spinlock_t lock;
+    bool attached;
+    u32 lcr, cr, imsc, ris, ibrd, fbrd;
+    u8 rx[PL011_FIFO_SZ];
+    unsigned int rx_head, rx_cnt;       //oldest character at rx_head
+    u8 tx[PL011_FIFO_SZ];
+    unsigned int tx_head, tx_cnt;
+    /* generator */
+    struct hrtimer tick;
+    ktime_t last;
+    u64 credit_ns;                      //time not yet turned into slots
+    u64 gap_left_ns;
+    unsigned int burst_left;
+    u8 seq;
+    /* interrupt line */
+    irq_handler_t handler;
+    void *dev_id;
+} pl011_model;
+
+static pl011_model model;
+
+static uint baud = 115200;
+static uint burst = 64;
+static uint gap_us = 1000;
+static uint tick_us = 50;
+module_param(baud, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(baud, "line rate in bits/s, 10 bits per character");
+module_param(burst, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(burst, "characters per RX burst, 0 disables the generator");
+module_param(gap_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gap_us, "silence between bursts");
+module_param(tick_us, uint, S_IRUGO);
+MODULE_PARM_DESC(tick_us, "model time step");
+/* counters, read-only */
+static ulong rx_generated, rx_overrun, tx_bytes, tx_dropped, irqs;
+module_param(rx_generated, ulong, S_IRUGO);
+module_param(rx_overrun, ulong, S_IRUGO);
+module_param(tx_bytes, ulong, S_IRUGO);
+module_param(tx_dropped, ulong, S_IRUGO);
+module_param(irqs, ulong, S_IRUGO);
+
+/* all helpers below are called with model.lock held */
+static void model_rx_push(pl011_model *m, u8 c)
+{
+    if(m->rx_cnt == PL011_FIFO_SZ)
+    {
+        rx_overrun++;
+        m->ris |= PL011_INT_OE;
+        return;
+    }
+    m->rx[(m->rx_head + m->rx_cnt) % PL011_FIFO_SZ] = c;
+    if(++m->rx_cnt >= MODEL_RX_LEVEL)
+        m->ris |= PL011_INT_RX;
+}
+
+static u8 model_rx_pop(pl011_model *m)
+{
+    u8 c = 0;
+    if(m->rx_cnt)
+    {
+        c = m->rx[m->rx_head];
+        m->rx_head = (m->rx_head + 1) % PL011_FIFO_SZ;
+        m->rx_cnt--;
+    }
+    if(m->rx_cnt < MODEL_RX_LEVEL)
+        m->ris &= ~PL011_INT_RX;
+    if(!m->rx_cnt)
+        m->ris &= ~PL011_INT_RT;
+    return c;
+}
+
+static void model_tx_push(pl011_model *m, u8 c)
+{
+    if(m->tx_cnt == PL011_FIFO_SZ)
+    {
+        tx_dropped++;
+        return;
+    }
+    m->tx[(m->tx_head + m->tx_cnt) % PL011_FIFO_SZ] = c;
+    if(++m->tx_cnt > MODEL_TX_LEVEL)
+        m->ris &= ~PL011_INT_TX;
+}
+
+/* One character time on the line */
+static bool model_slot(pl011_model *m, u64 char_ns)
+{
+    bool rx_new = false;
+    if(m->tx_cnt)
+    {
+        u8 c = m->tx[m->tx_head];
+        m->tx_head = (m->tx_head + 1) % PL011_FIFO_SZ;
+        if(m->tx_cnt-- == MODEL_TX_LEVEL + 1)
+            m->ris |= PL011_INT_TX;
+        tx_bytes++;
+        if(m->cr & PL011_CR_LBE)
+        {
+            model_rx_push(m, c);
+            rx_new = true;
+        }
+    }
+    if(m->burst_left)
+    {
+        model_rx_push(m, m->seq++);
+        rx_generated++;
+        rx_new = true;
+        if(!--m->burst_left)
+            m->gap_left_ns = (u64)gap_us * NSEC_PER_USEC;
+    }
+    else if(m->gap_left_ns > char_ns)
+        m->gap_left_ns -= char_ns;
+    else
+    {
+        m->gap_left_ns = 0;
+        m->burst_left = burst;
+    }
+    return rx_new;
+}
+
+static enum hrtimer_restart model_tick(struct hrtimer *t)
+{
+    pl011_model *m = container_of(t, pl011_model, tick);
+    ktime_t now = ktime_get();
+    u64 char_ns = div_u64(10ULL * NSEC_PER_SEC, max(baud, 1U));
+    unsigned int slots = 0;
+    bool rx_new = false;
+    irq_handler_t handler = NULL;
+    void *dev_id = NULL;
+    spin_lock(&m->lock);
+    m->credit_ns += ktime_to_ns(ktime_sub(now, m->last));
+    m->last = now;
+    for(; m->credit_ns >= char_ns && slots < MODEL_MAX_SLOTS; slots++)
+    {
+        m->credit_ns -= char_ns;
+        rx_new |= model_slot(m, char_ns);
+    }
+    if(slots == MODEL_MAX_SLOTS)
+        m->credit_ns = 0;
+    //a quiet tick with characters left behind is the receive timeout
+    if(!rx_new && m->rx_cnt)
+        m->ris |= PL011_INT_RT;
+    if( (m->ris & m->imsc) && m->handler )
+    {
+        handler = m->handler;
+        dev_id = m->dev_id;
+    }
+    spin_unlock(&m->lock);
+    //the handler accesses the registers, so the lock is dropped first
+    if(handler)
+    {
+        irqs++;
+        handler(0, dev_id);
+    }
+    hrtimer_forward_now(t, us_to_ktime(tick_us));
+    return HRTIMER_RESTART;
+}
+
+static u32 model_read(void *ctx, unsigned int reg)
+{
+    pl011_model *m = ctx;
+    unsigned long flags;
+    u32 val = 0;
+    spin_lock_irqsave(&m->lock, flags);
+    switch(reg)
+    {
+        case PL011_DR:
+            val = model_rx_pop(m);
+            break;
+        case PL011_FR:
+            val |= m->rx_cnt ? 0 : PL011_FR_RXFE;
+            val |= m->rx_cnt == PL011_FIFO_SZ ? PL011_FR_RXFF : 0;
+            val |= m->tx_cnt ? PL011_FR_BUSY : PL011_FR_TXFE;
+            val |= m->tx_cnt == PL011_FIFO_SZ ? PL011_FR_TXFF : 0;
+            break;
+        case PL011_IBRD: val = m->ibrd; break;
+        case PL011_FBRD: val = m->fbrd; break;
+        case PL011_LCR: val = m->lcr; break;
+        case PL011_CR: val = m->cr; break;
+        case PL011_IMSC: val = m->imsc; break;
+        case PL011_RIS: val = m->ris; break;
+        case PL011_MIS: val = m->ris & m->imsc; break;
+        default: break;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+    return val;
+}
+
+static void model_write(void *ctx, unsigned int reg, u32 val)
+{
+    pl011_model *m = ctx;
+    unsigned long flags;
+    spin_lock_irqsave(&m->lock, flags);
+    switch(reg)
+    {
+        case PL011_DR:
+            model_tx_push(m, val & 0xff);
+            break;
+        case PL011_IBRD: m->ibrd = val; break;
+        case PL011_FBRD: m->fbrd = val; break;
+        case PL011_LCR: m->lcr = val; break;
+        case PL011_CR: m->cr = val; break;
+        case PL011_IMSC: m->imsc = val & PL011_INT_ALL; break;
+        case PL011_ICR: m->ris &= ~val; break;
+        default: break;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+}
+
+/* One lock round trip per burst instead of two per character */
+static size_t model_rx_burst(void *ctx, u8 *buf, size_t max,
+        unsigned int fifo)
+{
+    pl011_model *m = ctx;
+    unsigned long flags;
+    size_t n=0;
+    spin_lock_irqsave(&m->lock, flags);
+    while( n < max && m->rx_cnt )
+        buf[n++] = model_rx_pop(m);
+    spin_unlock_irqrestore(&m->lock, flags);
+    return n;
+}
+
+static size_t model_tx_burst(void *ctx, const u8 *buf, size_t len,
+        unsigned int fifo)
+{
+    pl011_model *m = ctx;
+    unsigned long flags;
+    size_t n=0;
+    spin_lock_irqsave(&m->lock, flags);
+    while( n < len && m->tx_cnt < PL011_FIFO_SZ )
+        model_tx_push(m, buf[n++]);
+    spin_unlock_irqrestore(&m->lock, flags);
+    return n;
+}
+
+static int model_request_irq(void *ctx, irq_handler_t handler, void *dev_id)
+{
+    pl011_model *m = ctx;
+    unsigned long flags;
+    int err = 0;
+    spin_lock_irqsave(&m->lock, flags);
+    if(m->handler)
+        err = -EBUSY;
+    else
+    {
+        m->handler = handler;
+        m->dev_id = dev_id;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+    return err;
+}
+
+static void model_free_irq(void *ctx, void *dev_id)
+{
+    /* like free_irq(): on return the handler is not running anywhere */
+    pl011_model *m = ctx;
+    hrtimer_cancel(&m->tick);
+    spin_lock_irq(&m->lock);
+    m->handler = NULL;
+    m->dev_id = NULL;
+    spin_unlock_irq(&m->lock);
+    hrtimer_start(&m->tick, us_to_ktime(tick_us), HRTIMER_MODE_REL);
+}
+
+static void *model_attach(void)
+{
+    pl011_model *m = &model;
+    spin_lock_irq(&m->lock);
+    if(m->attached)
+    {
+        spin_unlock_irq(&m->lock);
+        return NULL;
+    }
+    m->attached = true;
+    m->lcr = m->cr = m->imsc = m->ris = 0;
+    m->rx_head = m->rx_cnt = m->tx_head = m->tx_cnt = 0;
+    m->credit_ns = m->gap_left_ns = 0;
+    m->burst_left = burst;
+    m->seq = 0;
+    m->last = ktime_get();
+    spin_unlock_irq(&m->lock);
+    hrtimer_start(&m->tick, us_to_ktime(tick_us), HRTIMER_MODE_REL);
+    return m;
+}
+
+static void model_detach(void *ctx)
+{
+    pl011_model *m = ctx;
+    hrtimer_cancel(&m->tick);
+    spin_lock_irq(&m->lock);
+    m->attached = false;
+    m->handler = NULL;
+    spin_unlock_irq(&m->lock);
+}
+
+const struct pl011_regs_ops pl011_model_ops = {
+    .name = "model",
+    .attach = model_attach,
+    .detach = model_detach,
+    .read = model_read,
+    .write = model_write,
+    .rx_burst = model_rx_burst,
+    .tx_burst = model_tx_burst,
+    .request_irq = model_request_irq,
+    .free_irq = model_free_irq,
+};
+EXPORT_SYMBOL_GPL(pl011_model_ops);
+
+static int __init pl011_model_init(void)
+{
+    spin_lock_init(&model.lock);
+    hrtimer_init(&model.tick, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    model.tick.function = model_tick;
+    printk(KERN_ALERT "pl011 model: %u baud, burst %u, gap %u us\n",
+            baud, burst, gap_us);
+    return 0;
+}
+
+static void __exit pl011_model_exit(void)
+{
+    //pl011_uart holds a reference while attached, nothing is running here
+    printk(KERN_ALERT "pl011 model unloaded\n");
+}
+
+module_init(pl011_model_init);
+module_exit(pl011_model_exit);
+
+MODULE_AUTHOR("Maciej Bielski");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Software PL011 register model with a traffic generator");
@@ -0,0 +1,85 @@
+#ifndef PL011_REGS_H
+#define PL011_REGS_H
+/* Register access layer of the PL011 driver. The driver core never touches
+ * the registers directly, it goes through a pl011_regs_ops table instead:
+ * - hardware: ioread/iowrite on the ioremapped block, real IRQ line,
+ * - model: pl011_model.ko, a software PL011 with a traffic generator, so the
+ *   RX/TX path can be exercised and benchmarked on any Linux box.
+ * Kernel-only header, the user-space interface is in pl011_uart.h.
+ */
+#include <linux/types.h>
+#include <linux/interrupt.h>        //irq_handler_t
+
+//register offsets
+#define PL011_DR 0x00
+#define PL011_FR 0x18
+#define PL011_IBRD 0x24
+#define PL011_FBRD 0x28
+#define PL011_LCR 0x2c              //LCR_H
+#define PL011_CR 0x30
+#define PL011_IFLS 0x34
+#define PL011_IMSC 0x38
+#define PL011_RIS 0x3c
+#define PL011_MIS 0x40
+#define PL011_ICR 0x44
+#define PL011_PERIPHID0 0xfe0
+#define PL011_PERIPHID1 0xfe4
+#define PL011_PERIPHID2 0xfe8       //bits 7:4 revision
+
+//flag register
+#define PL011_FR_BUSY (1<<3)
+#define PL011_FR_RXFE (1<<4)
+#define PL011_FR_TXFF (1<<5)
+#define PL011_FR_RXFF (1<<6)
+#define PL011_FR_TXFE (1<<7)
+//line control
+#define PL011_LCR_PEN (1<<1)
+#define PL011_LCR_EPS (1<<2)
+#define PL011_LCR_STP2 (1<<3)
+#define PL011_LCR_FEN (1<<4)
+#define PL011_LCR_WLEN5 (0<<5)
+#define PL011_LCR_WLEN6 (1<<5)
+#define PL011_LCR_WLEN7 (2<<5)
+#define PL011_LCR_WLEN8 (3<<5)
+//control register
+#define PL011_CR_UARTEN (1<<0)
+#define PL011_CR_LBE (1<<7)
+#define PL011_CR_TXE (1<<8)
+#define PL011_CR_RXE (1<<9)
+//interrupt bits, same layout in IMSC, RIS, MIS and ICR
+#define PL011_INT_RX (1<<4)
+#define PL011_INT_TX (1<<5)
+#define PL011_INT_RT (1<<6)
+#define PL011_INT_OE (1<<10)
+#define PL011_INT_ALL 0x7ff
+
+/* Deepest FIFO (r1p5 and later), what buffers are sized for. Earlier
+ * revisions and QEMU have 16 entries, the driver keeps the real depth. */
+#define PL011_FIFO_SZ 32
+
+/* @ctx is what attach() returned (or the ioremapped base for hardware),
+ * @reg is one of the offsets above.
+ * rx_burst/tx_burst are optional: move up to @max/@len characters through
+ * DR while FR allows and return how many, with one barrier per call rather
+ * than one per access. Without them the driver loops over read/write.
+ * @fifo is the FIFO depth, 0 if unknown: then only counts FR vouches for
+ * one by one may be moved.
+ */
+struct pl011_regs_ops
+{
+    const char *name;
+    void *(*attach)(void);
+    void (*detach)(void *ctx);
+    u32 (*read)(void *ctx, unsigned int reg);
+    void (*write)(void *ctx, unsigned int reg, u32 val);
+    size_t (*rx_burst)(void *ctx, u8 *buf, size_t max, unsigned int fifo);
+    size_t (*tx_burst)(void *ctx, const u8 *buf, size_t len,
+            unsigned int fifo);
+    int (*request_irq)(void *ctx, irq_handler_t handler, void *dev_id);
+    void (*free_irq)(void *ctx, void *dev_id);
+};
+
+//exported by pl011_model.ko, taken with symbol_get() so it stays optional
+extern const struct pl011_regs_ops pl011_model_ops;
+
+#endif //PL011_REGS_H
@@ -53,22 +53,50 @@
 #include <asm-generic/current.h>    //current()
 #include <linux/kfifo.h>            //generic fifo implementation
 #include <linux/workqueue.h>        //work queue
+#include <linux/poll.h>             //poll_wait()
+#include <linux/ktime.h>            //RX time stamps
+#include <linux/serial_core.h>      //uart_driver, uart_port
+#include <linux/tty_flip.h>         //tty_insert_flip_string()
+#include <linux/uio.h>              //iov_iter
+#include <linux/eventfd.h>          //RX watermark notification
+#include <linux/pm_runtime.h>       //autosuspend of idle ports
+#include <linux/timex.h>            //get_cycles()
+#include <linux/hrtimer.h>          //polling mode
+#include <linux/filter.h>           //classic BPF RX filter
+#include <linux/skbuff.h>           //its packet
+#include <linux/highmem.h>          //kmap() of pinned TX pages
+#include "pl011_regs.h"
+#include "pl011_uart.h"
+#include "embb_ring.h"
 
 #define MINOR_FIRST 0           //first requested minor
 #define MINOR_NB 1              //nb of minors requested
 #define DEV_NAME "pl011_uart"
-#define RBUFF_SZ 64
-#define RPACKET_SZ 4
-#define WBUFF_SZ 8
+#define RBUFF_SZ 4096          //power of 2, r_ring refuses anything else
+#define TBUFF_SZ 4096           //t_ring, TX coalescing, power of 2
+#define UBUFF_SZ 64             //u_ring, urgent TX lane, power of 2
+#define STAMPS_NB 256           //RX time stamp records, power of 2
+#define ARRIVALS_NB 64          //drain start marks for the latency histogram, power of 2
+#define POLL_DEFAULT_US 1000      //period when there is no interrupt line
+#define POLL_MIN_US 100           //shorter periods are a timer interrupt storm
+#define POLL_MAX_US 1000000
+#define PRBS_SEED 0x7fff          //self-test LFSR, any non-zero 15 bit value
+#define SELFTEST_MAX_MS 10000     //longest self-test run
+#define BUSY_POLL_MAX_US 1000     //per read, any opener may set it
+#define FANOUT_SZ 16384         //shared RX ring of fanout=1, power of 2
+//bytes a reader may lag behind, one FIFO load less than the ring: the bottom
+//half writes up to that much past the published head
+#define FANOUT_WINDOW (FANOUT_SZ - PL011_FIFO_SZ)
+#define TX_PIN_MIN PAGE_SIZE     //writes from this size on are sent in place
+#define TX_PIN_PAGES 16         //user pages pinned at a time
+#define SLIP_END 0xc0
+#define SLIP_ESC 0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
 
-//device registers
+//device registers, offsets are in pl011_regs.h
 #define PL011_PHYS_ADD 0xe0000000
 #define PL011_MEM_SZ 0x1000
-#define PL011_OFFSET( add, offset ) ({ (const void*)((add)+(offset)); })
-#define PL011_DR(base) (base)
-#define PL011_LCR(base) PL011_OFFSET( (base), 0x2c)
-#define PL011_IMSC(base) PL011_OFFSET( (base), 0x38)
-#define PL011_ICR(base) PL011_OFFSET( (base), 0x44)
 
 typedef struct pl011_dev pl011_dev;
 
@@ -80,178 +108,2141 @@ typedef struct pl011_work
 
 struct pl011_dev
 {
-    unsigned char *w_buff;
     unsigned char *iomem;
     unsigned long io_start;
     unsigned long io_size;
     struct resource* io_mem_region;
+    const struct pl011_regs_ops *ops;   //hardware or model
+    void *regs;                         //ops context
+    unsigned int fifo_sz;               //FIFO depth, 0: unknown
     struct cdev chrdev;
     struct semaphore sem;
     //int irq_pending;
-    spinlock_t flag_lock;
+    spinlock_t flag_lock;       //irq_stamp, rx_efd
     wait_queue_head_t rqh;      //read queue head
-    struct kfifo r_fifo;
+    wait_queue_head_t wqh;      //writers waiting for TX FIFO room
+    struct embb_ring r_ring;    //bottom half -> read(), lock-free
+    struct mutex rx_lock;       //one drainer: bottom half or a busy poller
     struct pl011_work r_work;
+    /* RX time stamps: the IRQ handler notes when the first RX interrupt
+     * since the last drain came, the bottom half turns it into a record of
+     * the drained burst. Readers fetch them with PL011_GET_STAMPS. */
+    ktime_t irq_stamp;
+    u64 rx_seq;
+    bool stamp_lost;
+    DECLARE_KFIFO_PTR(ts_fifo, struct pl011_rx_stamp);
+    /* Where each drain started queueing and when its data came, so read()
+     * can tell how old the first byte it hands out is. Under flag_lock. */
+    struct {
+        unsigned int pos;       //r_ring head or fo_head at drain start
+        u64 ts_ns;
+    } arrivals[ARRIVALS_NB];
+    unsigned int arr_head;
+    /* Framing: the bottom half decodes into f_buff, a complete frame goes to
+     * r_ring as one record, read() then takes one frame. */
+    int framing;                //PL011_FRAME_*
+    unsigned char *f_buff;
+    u16 f_len;                  //bytes in f_buff
+    u16 f_need;                 //LEN16: payload length
+    u8 f_hdr;                   //LEN16: header bytes seen
+    bool f_esc;                 //SLIP: previous byte was ESC
+    bool f_bad;                 //drop until the end of this frame
+    /* RX filter: runs over each frame or FIFO load before it is queued,
+     * rx_skb is the packet it sees. Both under rx_lock. */
+    struct bpf_prog *rx_filter;
+    struct sk_buff *rx_skb;
+    /* Notification: SIGIO to fasync owners on every drained burst, the
+     * eventfd only when r_ring crosses rx_mark, re-armed by read() */
+    struct fasync_struct *async_queue;
+    struct eventfd_ctx *rx_efd;
+    unsigned int rx_mark;
+    bool rx_armed;
+    /* Fan-out (fanout=1): the bottom half appends to fo_buf and only moves
+     * fo_head, every open file reads behind it with its own cursor. Nobody
+     * waits for slow readers, they lose the oldest bytes instead. */
+    unsigned char *fo_buf;
+    unsigned long fo_head;      //bytes ever written, free running
+    struct mutex open_lock;     //users, IRQ set up by the first open
+    unsigned int users;
+    bool selftest;              //PL011_SELFTEST owns the port, no open/write
+    /* Interrupt source: the IRQ line, or poll_timer calling the same handler
+     * every poll_ns when there is no line or it costs too much */
+    irq_handler_t handler;
+    struct hrtimer poll_timer;
+    u64 poll_ns;                //0: use the IRQ
+    bool polling;
+    /* Runtime PM: the port is powered while a file is open and autosuspends
+     * after the last release; the registers are kept here meanwhile. */
+    struct device *dev;
+    u32 pm_ibrd, pm_fbrd, pm_lcr, pm_cr, pm_imsc;
+    bool gated;
+    bool pm_retry;              //a suspend was refused, TX was busy
+    /* TX coalescing (tx_batch != 0): small writes are queued in t_ring and
+     * pushed once tx_batch bytes are there or tx_timer expires, the TX
+     * interrupt keeps the FIFO fed from it after that. */
+    struct embb_ring t_ring;
+    struct mutex tx_lock;       //t_ring producers, settings
+    spinlock_t tx_slock;        //t_ring consumer: IRQ, timer or a writer
+    struct hrtimer tx_timer;
+    u32 tx_batch;
+    u64 tx_delay_ns;
+    /* Urgent TX lane: every FIFO push empties u_ring first and adds no bulk
+     * data while it is not empty. u_lock covers both sides of u_ring and
+     * every write to the TX FIFO, whoever makes it. */
+    struct embb_ring u_ring;
+    spinlock_t u_lock;
+    struct uart_port port;      //tty front end, only with tty=1
 };
 
+/* Per open file */
+typedef struct pl011_file
+{
+    pl011_dev *uart;
+    struct semaphore sem;       //fan-out: tail, one reader per file
+    unsigned long tail;         //fan-out cursor, position in the stream
+    u64 lost;                   //fan-out: bytes overwritten before read
+    u32 busy_us;                //busy-poll budget per read, 0: off
+    u32 lat[PL011_LAT_BUCKETS]; //read() latencies, under the reader sem
+    u32 wake_bytes;             //wakeup coalescing, 0: every arrival
+    u32 wake_us;                //deadline once data is below wake_bytes
+    bool wake_due;              //the deadline passed, wake regardless
+    struct hrtimer wake_timer;
+} pl011_file;
+
+static inline pl011_dev *file_uart(struct file *filep)
+{
+    return ((pl011_file *)filep->private_data)->uart;
+}
 
 static struct class *pl011_class = NULL;
 static struct pl011_dev *pl011_device = NULL;
 static unsigned int pl011_major=0;
 //access address - is it possible to not make it global?
-static const int irq_nb = 0x14;         //first column in 'cat /proc/interrupts' output
+static int irq_nb = 0x14;               //first column in 'cat /proc/interrupts' output
 //size_t uart_id = 0xC0CADEAD;          //used for shared IRQ lines
+static ulong phys_add = PL011_PHYS_ADD;
+static bool use_model = false;
+static bool loopback = false;
+static bool tty = false;
+static uint uartclk = 24000000;
+static uint fifo_sz = 0;
+static bool fanout = false;
+static uint poll_us = 0;
+static bool burst_io = true;
+static bool cycstat = false;
+static bool tx_pin = true;
+static int autosuspend_ms = 2000;
+static ulong resume_ns = 0;
+module_param(irq_nb, int, S_IRUGO);
+module_param(phys_add, ulong, S_IRUGO);
+MODULE_PARM_DESC(phys_add, "register block, e.g. 0x09000000 on QEMU virt");
+module_param(use_model, bool, S_IRUGO);
+MODULE_PARM_DESC(use_model, "run against pl011_model.ko instead of hardware");
+module_param(loopback, bool, S_IRUGO);
+MODULE_PARM_DESC(loopback, "set CR.LBE on open, TX comes back on RX");
+module_param(tty, bool, S_IRUGO);
+MODULE_PARM_DESC(tty, "serve the port as /dev/ttyPL0 instead of the raw cdev");
+module_param(uartclk, uint, S_IRUGO);
+MODULE_PARM_DESC(uartclk, "UARTCLK in Hz, for the tty baud rate divisor");
+module_param(fifo_sz, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_sz, "FIFO depth (16 or 32), 0: from the PeriphID registers");
+module_param(fanout, bool, S_IRUGO);
+MODULE_PARM_DESC(fanout, "every open file reads the whole RX stream");
+module_param(poll_us, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_us, "poll the port every poll_us instead of the IRQ, 0: IRQ");
+module_param(burst_io, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(burst_io, "move DR runs with the backend's burst ops");
+module_param(cycstat, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cycstat, "count CPU cycles spent in the RX/TX FIFO loops");
+module_param(tx_pin, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_pin, "send large writes from the pinned user pages");
+/* cycstat counters: cycles/chars is the per-character cost, compare runs
+ * with burst_io=0 and burst_io=1 */
+static ulong rx_cycles, rx_chars, tx_cycles, tx_chars;
+module_param(rx_cycles, ulong, S_IRUGO);
+module_param(rx_chars, ulong, S_IRUGO);
+module_param(tx_cycles, ulong, S_IRUGO);
+module_param(tx_chars, ulong, S_IRUGO);
+module_param(autosuspend_ms, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_ms, "idle time before the port is gated, <0: never");
+module_param(resume_ns, ulong, S_IRUGO);
+MODULE_PARM_DESC(resume_ns, "duration of the last resume, read-only");
+static ulong rx_filtered;
+module_param(rx_filtered, ulong, S_IRUGO);
+MODULE_PARM_DESC(rx_filtered, "bytes dropped by the RX filter, read-only");
+
+static inline u32 pl011_rd(pl011_dev *uart, unsigned int reg)
+{
+    return uart->ops->read(uart->regs, reg);
+}
+
+static inline void pl011_wr(pl011_dev *uart, unsigned int reg, u32 val)
+{
+    uart->ops->write(uart->regs, reg, val);
+}
+
+/* Hardware backend, the context is the ioremapped register block */
+static u32 pl011_hw_read(void *ctx, unsigned int reg)
+{
+    return ioread32((unsigned char *)ctx + reg);
+}
+
+static void pl011_hw_write(void *ctx, unsigned int reg, u32 val)
+{
+    iowrite32(val, (unsigned char *)ctx + reg);
+}
+
+/* Relaxed accessors keep device accesses in program order among themselves
+ * but skip the barrier ioread32/iowrite32 add on every access. A full FIFO
+ * (RXFF) or an empty one (TXFE) of known depth is moved with readsb/writesb
+ * without looking at FR in between. */
+static size_t pl011_hw_rx_burst(void *ctx, u8 *buf, size_t max,
+        unsigned int fifo)
+{
+    void __iomem *base = ctx;
+    size_t n=0;
+    u32 fr = readl_relaxed(base + PL011_FR);
+    if( fifo && (fr & PL011_FR_RXFF) && max >= fifo )
+    {
+        readsb(base + PL011_DR, buf, fifo);
+        n = fifo;
+        fr = readl_relaxed(base + PL011_FR);
+    }
+    while( n < max && !(fr & PL011_FR_RXFE) )
+    {
+        buf[n++] = readl_relaxed(base + PL011_DR);
+        fr = readl_relaxed(base + PL011_FR);
+    }
+    //characters are in buf before the caller looks at them
+    rmb();
+    return n;
+}
+
+static size_t pl011_hw_tx_burst(void *ctx, const u8 *buf, size_t len,
+        unsigned int fifo)
+{
+    void __iomem *base = ctx;
+    size_t n=0;
+    u32 fr = 0;
+    //buf is written before the first character goes out
+    wmb();
+    fr = readl_relaxed(base + PL011_FR);
+    if( fifo && (fr & PL011_FR_TXFE) )
+    {
+        n = min_t(size_t, len, fifo);
+        writesb(base + PL011_DR, buf, n);
+        fr = readl_relaxed(base + PL011_FR);
+    }
+    while( n < len && !(fr & PL011_FR_TXFF) )
+    {
+        writel_relaxed(buf[n++], base + PL011_DR);
+        fr = readl_relaxed(base + PL011_FR);
+    }
+    return n;
+}
+
+static int pl011_hw_request_irq(void *ctx, irq_handler_t handler, void *dev_id)
+{
+    return request_irq(irq_nb, handler, 0, DEV_NAME, dev_id);
+}
+
+static void pl011_hw_free_irq(void *ctx, void *dev_id)
+{
+    disable_irq(irq_nb);
+    free_irq(irq_nb, dev_id);
+}
+
+static const struct pl011_regs_ops pl011_hw_ops = {
+    .name = "hw",
+    .read = pl011_hw_read,
+    .write = pl011_hw_write,
+    .rx_burst = pl011_hw_rx_burst,
+    .tx_burst = pl011_hw_tx_burst,
+    .request_irq = pl011_hw_request_irq,
+    .free_irq = pl011_hw_free_irq,
+};
+
+/* RX/TX engine shared by the raw cdev and the tty front end. pull takes up
+ * to @max characters out of the hardware FIFO, push feeds it as much of @buf
+ * as fits; both return the number of characters moved and never wait.
+ */
+static size_t pl011_rx_pull(pl011_dev *uart, u8 *buf, size_t max)
+{
+    size_t n=0;
+    cycles_t t0 = cycstat ? get_cycles() : 0;
+    if( burst_io && uart->ops->rx_burst )
+        n = uart->ops->rx_burst(uart->regs, buf, max, uart->fifo_sz);
+    else
+        //DR holds one character per read, upper bits are error flags
+        while( n < max && !(pl011_rd(uart, PL011_FR) & PL011_FR_RXFE) )
+            buf[n++] = pl011_rd(uart, PL011_DR);
+    if(cycstat)
+    {
+        rx_cycles += get_cycles() - t0;
+        rx_chars += n;
+    }
+    return n;
+}
+
+static size_t pl011_tx_fifo(pl011_dev *uart, const u8 *buf, size_t len)
+{
+    size_t n=0;
+    cycles_t t0 = cycstat ? get_cycles() : 0;
+    if( burst_io && uart->ops->tx_burst )
+        n = uart->ops->tx_burst(uart->regs, buf, len, uart->fifo_sz);
+    else
+        while( n < len && !(pl011_rd(uart, PL011_FR) & PL011_FR_TXFF) )
+            pl011_wr(uart, PL011_DR, buf[n++]);
+    if(cycstat)
+    {
+        tx_cycles += get_cycles() - t0;
+        tx_chars += n;
+    }
+    return n;
+}
+
+/* Moves the urgent lane to the FIFO, true once it is empty. u_lock held */
+static bool __pl011_urgent_push(pl011_dev *uart)
+{
+    unsigned int n=0, pushed=0;
+    void *p = NULL;
+    while( (n = embb_ring_peek(&uart->u_ring, &p)) )
+    {
+        pushed = pl011_tx_fifo(uart, p, n);
+        embb_ring_commit(&uart->u_ring, pushed);
+        if(pushed < n)
+            break;
+    }
+    return embb_ring_empty(&uart->u_ring);
+}
+
+static bool pl011_urgent_push(pl011_dev *uart)
+{
+    unsigned long flags;
+    bool empty;
+    spin_lock_irqsave(&uart->u_lock, flags);
+    empty = __pl011_urgent_push(uart);
+    spin_unlock_irqrestore(&uart->u_lock, flags);
+    return empty;
+}
+
+/* Every path to the TX FIFO. One writer at a time: the burst ops fill the
+ * FIFO on a single TXFE look, and bulk data only goes in behind urgent
+ * bytes. */
+static size_t pl011_tx_push(pl011_dev *uart, const u8 *buf, size_t len)
+{
+    unsigned long flags;
+    size_t n=0;
+    spin_lock_irqsave(&uart->u_lock, flags);
+    if( __pl011_urgent_push(uart) )
+        n = pl011_tx_fifo(uart, buf, len);
+    spin_unlock_irqrestore(&uart->u_lock, flags);
+    return n;
+}
+
+/* A runtime suspend refused while TX was busy is asked for again once a TX
+ * or RX path found it idle. Async, any context. */
+static void pl011_pm_rearm(pl011_dev *uart)
+{
+    if( !READ_ONCE(uart->pm_retry) )
+        return;
+    WRITE_ONCE(uart->pm_retry, false);
+    pm_runtime_mark_last_busy(uart->dev);
+    pm_request_autosuspend(uart->dev);
+}
+
+/* Moves t_ring to the FIFO as far as it takes it, then wakes writers: there
+ * is room in t_ring or the FIFO now. From the TX interrupt, tx_timer or a
+ * writer. */
+static void pl011_tx_refill(pl011_dev *uart)
+{
+    unsigned long flags;
+    unsigned int n=0, pushed=0;
+    void *p = NULL;
+    //urgent bytes do not wait for t_ring data to come along
+    pl011_urgent_push(uart);
+    //tx_slock then u_lock (in pl011_tx_push), never the other way round
+    spin_lock_irqsave(&uart->tx_slock, flags);
+    while( (n = embb_ring_peek(&uart->t_ring, &p)) )
+    {
+        pushed = pl011_tx_push(uart, p, n);
+        embb_ring_commit(&uart->t_ring, pushed);
+        if(pushed < n)
+            break;
+    }
+    spin_unlock_irqrestore(&uart->tx_slock, flags);
+    wake_up_interruptible(&uart->wqh);
+    if( embb_ring_empty(&uart->t_ring) && embb_ring_empty(&uart->u_ring) )
+        pl011_pm_rearm(uart);
+}
+
+static enum hrtimer_restart pl011_tx_tick(struct hrtimer *t)
+{
+    pl011_tx_refill(container_of(t, pl011_dev, tx_timer));
+    return HRTIMER_NORESTART;
+}
+
+//notes when the bytes the drain is about to queue came, before they are visible
+static void pl011_arrival_mark(pl011_dev *uart)
+{
+    unsigned int pos = fanout ? uart->fo_head : uart->r_ring.head;
+    unsigned long flags;
+    spin_lock_irqsave(&uart->flag_lock, flags);
+    //empty busy-poll drains must not push the real marks out
+    if( !uart->arrivals[(uart->arr_head-1) & (ARRIVALS_NB-1)].ts_ns ||
+        uart->arrivals[(uart->arr_head-1) & (ARRIVALS_NB-1)].pos != pos )
+        uart->arr_head++;
+    uart->arrivals[(uart->arr_head-1) & (ARRIVALS_NB-1)].pos = pos;
+    uart->arrivals[(uart->arr_head-1) & (ARRIVALS_NB-1)].ts_ns = uart->irq_stamp ?
+            ktime_to_ns(uart->irq_stamp) : ktime_get_ns();
+    spin_unlock_irqrestore(&uart->flag_lock, flags);
+}
+
+//arrival time of the byte at stream position pos, 0 if no longer known
+static u64 pl011_arrival(pl011_dev *uart, unsigned int pos)
+{
+    unsigned long flags;
+    unsigned int i;
+    u64 ts = 0;
+    spin_lock_irqsave(&uart->flag_lock, flags);
+    for(i=1; i<=ARRIVALS_NB; i++)
+    {
+        unsigned int k = (uart->arr_head - i) & (ARRIVALS_NB-1);
+        if(!uart->arrivals[k].ts_ns)
+            break;
+        //newest drain that started at or before pos queued it
+        if( (int)(pos - uart->arrivals[k].pos) >= 0 )
+        {
+            ts = uart->arrivals[k].ts_ns;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&uart->flag_lock, flags);
+    return ts;
+}
+
+static void pl011_put_stamp(pl011_dev *uart, size_t len)
+{
+    struct pl011_rx_stamp st;
+    unsigned long flags;
+    spin_lock_irqsave(&uart->flag_lock, flags);
+    st.ts_ns = ktime_to_ns(uart->irq_stamp);
+    uart->irq_stamp = 0;
+    spin_unlock_irqrestore(&uart->flag_lock, flags);
+    //drain restarted by read() without an interrupt
+    if(!st.ts_ns)
+        st.ts_ns = ktime_get_ns();
+    st.seq = uart->rx_seq;
+    st.len = len;
+    st.flags = uart->stamp_lost ? PL011_STAMP_LOST : 0;
+    uart->rx_seq += len;
+    //full: the consumer owns the out index, so mark the gap instead
+    uart->stamp_lost = !kfifo_put(&uart->ts_fifo, st);
+}
+
+static void pl011_frame_reset(pl011_dev *uart)
+{
+    uart->f_len = 0;
+    uart->f_need = 0;
+    uart->f_hdr = 0;
+    uart->f_esc = false;
+    uart->f_bad = false;
+}
+
+/* How many of the @len received bytes the RX filter keeps, called under
+ * rx_lock */
+static size_t pl011_rx_filter(pl011_dev *uart, const u8 *buf, size_t len)
+{
+    struct sk_buff *skb = uart->rx_skb;
+    size_t keep = len;
+    if( !uart->rx_filter || !len )
+        return len;
+    skb_trim(skb, 0);
+    skb_put_data(skb, buf, len);
+    keep = min_t(size_t, len, BPF_PROG_RUN(uart->rx_filter, skb));
+    rx_filtered += len - keep;
+    return keep;
+}
+
+/* Queues the decoded frame, returns its payload length.
+ * The drain loop guarantees room for a full frame and its length.
+ */
+static size_t pl011_frame_done(pl011_dev *uart)
+{
+    size_t len = uart->f_bad ? 0 : uart->f_len;
+    len = pl011_rx_filter(uart, uart->f_buff, len);
+    if(len)
+        embb_ring_put_rec(&uart->r_ring, uart->f_buff, len);
+    pl011_frame_reset(uart);
+    return len;
+}
+
+static void pl011_frame_add(pl011_dev *uart, u8 c)
+{
+    if(uart->f_len == PL011_FRAME_MAX)
+        uart->f_bad = true;
+    else
+        uart->f_buff[uart->f_len++] = c;
+}
+
+/* Feeds one received character to the decoder */
+static size_t pl011_frame_feed(pl011_dev *uart, u8 c)
+{
+    if(uart->framing == PL011_FRAME_SLIP)
+    {
+        if(c == SLIP_END)
+            return pl011_frame_done(uart);
+        if(uart->f_esc)
+        {
+            uart->f_esc = false;
+            if(c == SLIP_ESC_END)
+                c = SLIP_END;
+            else if(c == SLIP_ESC_ESC)
+                c = SLIP_ESC;
+            else
+                uart->f_bad = true;     //protocol violation
+        }
+        else if(c == SLIP_ESC)
+        {
+            uart->f_esc = true;
+            return 0;
+        }
+        pl011_frame_add(uart, c);
+        return 0;
+    }
+    //PL011_FRAME_LEN16
+    if(uart->f_hdr < 2)
+    {
+        uart->f_need = uart->f_need << 8 | c;
+        if(++uart->f_hdr == 2 && !uart->f_need)
+            pl011_frame_reset(uart);
+        return 0;
+    }
+    pl011_frame_add(uart, c);
+    if(uart->f_len == uart->f_need || uart->f_len == PL011_FRAME_MAX)
+    {
+        //oversized: the length is known, swallow the rest byte by byte
+        if(uart->f_len < uart->f_need)
+        {
+            uart->f_need -= uart->f_len;
+            uart->f_len = 0;
+            uart->f_bad = true;
+            return 0;
+        }
+        return pl011_frame_done(uart);
+    }
+    return 0;
+}
+
+/* Room needed by one pull in framing mode: the frame being decoded plus a
+ * FIFO load of new bytes, and a length field for each of the at most
+ * FIFO_SZ/2 frames that load can complete (a frame takes 2 characters) */
+#define FRAME_ROOM (PL011_FRAME_MAX + PL011_FIFO_SZ + \
+        (PL011_FIFO_SZ/2 + 1)*sizeof(u16))
+
+/* Raw mode needs one free byte per character. Framing mode pulls a whole
+ * hardware FIFO at once, a completed frame is never dropped */
+static bool pl011_rx_room(pl011_dev *uart)
+{
+    //fan-out never waits for readers
+    if(fanout)
+        return true;
+    if(uart->framing == PL011_FRAME_RAW)
+        return embb_ring_avail(&uart->r_ring, 1);
+    return embb_ring_avail(&uart->r_ring, FRAME_ROOM) >= FRAME_ROOM;
+}
+
+/* What read() waits for: any byte, or a whole frame, frames are only queued
+ * complete */
+static bool pl011_rx_empty(pl011_dev *uart)
+{
+    return embb_ring_empty(&uart->r_ring);
+}
+
+/* POWER:
+ * there is no clock or power domain to drive from here, gating the port means
+ * UARTEN/TXE/RXE off and all interrupts masked. Power up is a handful of
+ * register writes: divisor, LCR_H (which latches the divisor), CR, IMSC.
+ */
+static int pl011_power_down(pl011_dev *uart)
+{
+    u32 fr = pl011_rd(uart, PL011_FR);
+    //characters still going out or queued
+    if( !(fr & PL011_FR_TXFE) || (fr & PL011_FR_BUSY) ||
+            !embb_ring_empty(&uart->t_ring) || !embb_ring_empty(&uart->u_ring) )
+        return -EBUSY;
+    uart->pm_ibrd = pl011_rd(uart, PL011_IBRD);
+    uart->pm_fbrd = pl011_rd(uart, PL011_FBRD);
+    uart->pm_lcr = pl011_rd(uart, PL011_LCR);
+    uart->pm_cr = pl011_rd(uart, PL011_CR);
+    uart->pm_imsc = pl011_rd(uart, PL011_IMSC);
+    pl011_wr(uart, PL011_IMSC, 0);
+    pl011_wr(uart, PL011_CR, 0);
+    uart->gated = true;
+    return 0;
+}
+
+static void pl011_power_up(pl011_dev *uart)
+{
+    ktime_t t0 = ktime_get();
+    //nothing saved yet, the registers are as they were found
+    if(!uart->gated)
+        return;
+    uart->gated = false;
+    pl011_wr(uart, PL011_IBRD, uart->pm_ibrd);
+    pl011_wr(uart, PL011_FBRD, uart->pm_fbrd);
+    pl011_wr(uart, PL011_LCR, uart->pm_lcr);
+    pl011_wr(uart, PL011_CR, uart->pm_cr);
+    pl011_wr(uart, PL011_ICR, PL011_INT_ALL);
+    pl011_wr(uart, PL011_IMSC, uart->pm_imsc);
+    resume_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+}
+
+static int pl011_runtime_suspend(struct device *dev)
+{
+    pl011_dev *uart = dev_get_drvdata(dev);
+    int err = pl011_power_down(uart);
+    if(err == -EBUSY)
+    {
+        /* not a final no: the core reschedules the autosuspend on a new
+         * last_busy, the TX/RX paths re-arm it as soon as they drain */
+        WRITE_ONCE(uart->pm_retry, true);
+        pm_runtime_mark_last_busy(dev);
+    }
+    return err;
+}
+
+static int pl011_runtime_resume(struct device *dev)
+{
+    pl011_power_up(dev_get_drvdata(dev));
+    return 0;
+}
+
+/* set on the class, system sleep reuses the runtime callbacks */
+static const struct dev_pm_ops pl011_pm_ops = {
+    SET_SYSTEM_SLEEP_PM_OPS(pm_runtime_force_suspend, pm_runtime_force_resume)
+    SET_RUNTIME_PM_OPS(pl011_runtime_suspend, pl011_runtime_resume, NULL)
+};
+
+/* Appends to the fan-out ring and publishes the data by moving the head.
+ * @n is at most one FIFO load, see FANOUT_WINDOW. */
+static void pl011_fanout_put(pl011_dev *uart, const u8 *buf, size_t n)
+{
+    unsigned long head = uart->fo_head;
+    size_t off = head & (FANOUT_SZ-1);
+    size_t first = min_t(size_t, n, FANOUT_SZ - off);
+    memcpy(uart->fo_buf + off, buf, first);
+    memcpy(uart->fo_buf, buf + first, n - first);
+    smp_store_release(&uart->fo_head, head + n);
+}
+
+/* Nothing for this file to read */
+static bool pl011_file_empty(pl011_file *pf)
+{
+    if(fanout)
+        return smp_load_acquire(&pf->uart->fo_head) == pf->tail;
+    return pl011_rx_empty(pf->uart);
+}
+
+/* Bytes queued for this file, framed records count with their header */
+static size_t pl011_file_len(pl011_file *pf)
+{
+    if(fanout)
+        return min_t(unsigned long,
+                smp_load_acquire(&pf->uart->fo_head) - pf->tail, FANOUT_SZ);
+    return embb_ring_len(&pf->uart->r_ring);
+}
+
+/* A blocked reader of this file is worth waking */
+static bool pl011_file_ready(pl011_file *pf)
+{
+    u32 bytes = READ_ONCE(pf->wake_bytes);
+    if( pl011_file_empty(pf) )
+        return false;
+    return !bytes || READ_ONCE(pf->wake_due) || pl011_file_len(pf) >= bytes;
+}
+
+/* Data is waiting below wake_bytes, bound how long it may wait */
+static void pl011_wake_arm(pl011_file *pf)
+{
+    if( !READ_ONCE(pf->wake_due) && !hrtimer_active(&pf->wake_timer) )
+        hrtimer_start(&pf->wake_timer, us_to_ktime(pf->wake_us),
+                HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart pl011_wake_tick(struct hrtimer *t)
+{
+    pl011_file *pf = container_of(t, pl011_file, wake_timer);
+    WRITE_ONCE(pf->wake_due, true);
+    wake_up_interruptible(&pf->uart->rqh);
+    return HRTIMER_NORESTART;
+}
+
+struct pl011_waiter
+{
+    struct wait_queue_entry wq;
+    pl011_file *pf;
+};
+
+/* rqh wake function of a reader blocked in read(): the wakeup only goes
+ * through once its file is ready, below the threshold it starts the deadline
+ * and the reader keeps sleeping. Runs under the rqh lock.
+ */
+static int pl011_wake_fn(struct wait_queue_entry *wq, unsigned mode,
+        int sync, void *key)
+{
+    pl011_file *pf = container_of(wq, struct pl011_waiter, wq)->pf;
+    if( pl011_file_ready(pf) )
+        return autoremove_wake_function(wq, mode, sync, key);
+    if( !pl011_file_empty(pf) )
+        pl011_wake_arm(pf);
+    return 0;
+}
+
+/* Called by the bottom half after new data was queued, coalescing readers
+ * filter the wakeup in pl011_wake_fn */
+static void pl011_rx_notify(pl011_dev *uart)
+{
+    unsigned long flags;
+    wake_up_interruptible(&uart->rqh);
+    kill_fasync(&uart->async_queue, SIGIO, POLL_IN);
+    spin_lock_irqsave(&uart->flag_lock, flags);
+    if( uart->rx_efd && uart->rx_armed &&
+            embb_ring_len(&uart->r_ring) >= uart->rx_mark )
+    {
+        uart->rx_armed = false;
+        eventfd_signal(uart->rx_efd, 1);
+    }
+    spin_unlock_irqrestore(&uart->flag_lock, flags);
+}
+
+/* Called by readers after taking data, re-arms the eventfd below the mark */
+static void pl011_rx_rearm(pl011_dev *uart)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&uart->flag_lock, flags);
+    if( embb_ring_len(&uart->r_ring) < uart->rx_mark )
+        uart->rx_armed = true;
+    spin_unlock_irqrestore(&uart->flag_lock, flags);
+}
+
+/* Moves what the RX FIFO holds into the buffers and tells the readers.
+ * Runs in the bottom half, or in a busy-polling reader with @try set, which
+ * gives up rather than wait for a drain already running. */
+static size_t pl011_rx_drain(pl011_dev *uart, bool try)
+{
+    u8 buf[PL011_FIFO_SZ];
+    size_t len=0, n=0, i=0;
+    if(try)
+    {
+        if( !mutex_trylock(&uart->rx_lock) )
+            return 0;
+    }
+    else
+        mutex_lock(&uart->rx_lock);
+    pl011_arrival_mark(uart);
+    //drain the RX FIFO as long as there is room in r_ring
+    while( pl011_rx_room(uart) )
+    {
+        size_t max = sizeof(buf);
+        if(uart->framing == PL011_FRAME_RAW)
+            max = min_t(size_t, max, embb_ring_avail(&uart->r_ring, max));
+        n = pl011_rx_pull(uart, buf, max);
+        if(!n)
+            break;
+        if( fanout || uart->framing == PL011_FRAME_RAW )
+            n = pl011_rx_filter(uart, buf, n);
+        if(fanout)
+        {
+            pl011_fanout_put(uart, buf, n);
+            len += n;
+            continue;
+        }
+        if(uart->framing == PL011_FRAME_RAW)
+        {
+            embb_ring_in(&uart->r_ring, buf, n);
+            len += n;
+            continue;
+        }
+        for(i=0; i<n; i++)
+            len += pl011_frame_feed(uart, buf[i]);
+    }
+    if(len)
+    {
+        pl011_put_stamp(uart, len);
+        pl011_rx_notify(uart);
+    }
+    mutex_unlock(&uart->rx_lock);
+    pl011_pm_rearm(uart);
+    return len;
+}
+
+static void pl011_r_work_handler(struct work_struct *work)
+{
+    /* tricky way of obtaining the outer class pointer*/
+    pl011_work *work_container = NULL;
+    work_container = container_of(work, struct pl011_work, wrk);
+    pl011_rx_drain(work_container->opaque, false);
+}
+
+static irqreturn_t data_handler(int nb, void *dev_id)
+{
+    /* the trick: IRQ is turned off but on read it is checked whether
+     * it should be triggered again */
+    pl011_dev *uart = (pl011_dev *) dev_id;
+    u32 mis = pl011_rd(uart, PL011_MIS);
+    if(!mis)
+        return IRQ_NONE;
+    pl011_wr(uart, PL011_ICR, mis);
+    if( mis & (PL011_INT_RX | PL011_INT_RT) )
+    {
+        spin_lock(&uart->flag_lock);
+        if( !uart->irq_stamp )
+            uart->irq_stamp = ktime_get();
+        spin_unlock(&uart->flag_lock);
+        schedule_work(&uart->r_work.wrk);
+    }
+    //TX FIFO dropped to its trigger level
+    if( mis & PL011_INT_TX )
+        pl011_tx_refill(uart);
+    return IRQ_HANDLED;
+}
+
+/* Polling: the handler sees the same MIS as from the interrupt, IMSC stays
+ * programmed, only the line is not requested */
+static enum hrtimer_restart pl011_poll_tick(struct hrtimer *t)
+{
+    pl011_dev *uart = container_of(t, pl011_dev, poll_timer);
+    uart->handler(0, uart);
+    hrtimer_forward_now(t, ns_to_ktime(uart->poll_ns));
+    return HRTIMER_RESTART;
+}
+
+/* Starts @handler from the IRQ line or from poll_timer, as poll_ns says.
+ * When the line cannot be had the port falls back to polling. */
+static void pl011_irq_start(pl011_dev *uart, irq_handler_t handler)
+{
+    uart->handler = handler;
+    uart->polling = false;
+    if(!uart->poll_ns)
+    {
+        if( !uart->ops->request_irq(uart->regs, handler, uart) )
+            return;
+        printk(KERN_WARNING "request_irq() failed, polling every %u us\n",
+                POLL_DEFAULT_US);
+        uart->poll_ns = POLL_DEFAULT_US * NSEC_PER_USEC;
+    }
+    uart->polling = true;
+    hrtimer_start(&uart->poll_timer, ns_to_ktime(uart->poll_ns),
+            HRTIMER_MODE_REL);
+}
+
+static void pl011_irq_stop(pl011_dev *uart)
+{
+    if(uart->polling)
+        hrtimer_cancel(&uart->poll_timer);
+    else
+        uart->ops->free_irq(uart->regs, uart);
+}
+
+/* Switches an open port between the IRQ and polling at runtime */
+static long pl011_set_poll(pl011_dev *uart, u32 us)
+{
+    long err = 0;
+    if( us && (us < POLL_MIN_US || us > POLL_MAX_US) )
+        return -EINVAL;
+    mutex_lock(&uart->open_lock);
+    //the self-test runs with interrupts masked, leave them alone
+    if(uart->selftest)
+    {
+        mutex_unlock(&uart->open_lock);
+        return -EBUSY;
+    }
+    if(uart->users)
+        pl011_irq_stop(uart);
+    uart->poll_ns = (u64)us * NSEC_PER_USEC;
+    if(uart->users)
+    {
+        pl011_irq_start(uart, uart->handler);
+        if(!us && uart->polling)
+            err = -EIO;
+    }
+    mutex_unlock(&uart->open_lock);
+    return err;
+}
+
+static int pl011_open(struct inode *inode, struct file *filep)
+{
+    /* called on first access when filep->f_count==0 */
+    pl011_dev *uart = container_of( inode->i_cdev, struct pl011_dev, chrdev);
+    pl011_file *pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    int err=0;
+    if(!pf)
+        return -ENOMEM;
+    pf->uart = uart;
+    sema_init(&pf->sem, 1);
+    hrtimer_init(&pf->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    pf->wake_timer.function = pl011_wake_tick;
+    //powered as long as a file is open
+    err = pm_runtime_get_sync(uart->dev);
+    if(err < 0)
+    {
+        pm_runtime_put_noidle(uart->dev);
+        kfree(pf);
+        return err;
+    }
+    err = 0;
+    filep->private_data = pf;
+    filep->f_pos=0;
+    //read_iter/write_iter honour IOCB_NOWAIT (RWF_NOWAIT, io_uring)
+    filep->f_mode |= FMODE_NOWAIT;
+    mutex_lock(&uart->open_lock);
+    if(uart->selftest)
+    {
+        mutex_unlock(&uart->open_lock);
+        pm_runtime_mark_last_busy(uart->dev);
+        pm_runtime_put_autosuspend(uart->dev);
+        kfree(pf);
+        return -EBUSY;
+    }
+    //a new fan-out reader starts at the live end of the stream
+    pf->tail = smp_load_acquire(&uart->fo_head);
+    if(uart->users++)
+        goto out;
+    //setting IRQ (or polling), once for all users
+    pl011_irq_start(uart, data_handler);
+    pl011_wr(uart, PL011_LCR, PL011_LCR_FEN);    //enable FIFO
+    smp_wmb();
+    //uart->irq_pending=0;
+    pl011_wr(uart, PL011_IMSC, PL011_INT_RX | PL011_INT_TX | PL011_INT_RT);
+    if(loopback)
+        pl011_wr(uart, PL011_CR, pl011_rd(uart, PL011_CR) | PL011_CR_LBE);
+    printk(KERN_WARNING "open(), pos: %llu\n", filep->f_pos);
+out:
+    mutex_unlock(&uart->open_lock);
+    return err;
+}
+
+static int pl011_fasync(int fd, struct file *filep, int on)
+{
+    pl011_dev* uart = file_uart(filep);
+    return fasync_helper(fd, filep, on, &uart->async_queue);
+}
+
+static int pl011_release(struct inode *inode, struct file *filep)
+{
+    pl011_dev* uart = file_uart(filep);
+    pl011_fasync(-1, filep, 0);
+    mutex_lock(&uart->open_lock);
+    if(!--uart->users)
+    {
+        //coalesced TX still goes out, unless the line is stuck
+        pl011_tx_refill(uart);
+        wait_event_timeout(uart->wqh, embb_ring_empty(&uart->t_ring) &&
+                embb_ring_empty(&uart->u_ring), HZ);
+        pl011_wr(uart, PL011_IMSC, 0);
+        pl011_irq_stop(uart);
+        hrtimer_cancel(&uart->tx_timer);
+        embb_ring_reset(&uart->t_ring);
+        embb_ring_reset(&uart->u_ring);
+        printk(KERN_WARNING "release()\n");
+    }
+    mutex_unlock(&uart->open_lock);
+    pm_runtime_mark_last_busy(uart->dev);
+    pm_runtime_put_autosuspend(uart->dev);
+    hrtimer_cancel(&((pl011_file *)filep->private_data)->wake_timer);
+    kfree(filep->private_data);
+    return 0;
+}
+
+/* Either the caller asked not to block or the file is non-blocking */
+static inline bool pl011_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_flags & IOCB_NOWAIT) ||
+        (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/* Copies up to @len bytes from r_ring into @to without a bounce buffer, in
+ * place from the ring's (at most two) linear pieces.
+ * Returns the bytes consumed, short on a fault.
+ */
+static size_t pl011_ring_to_iter(pl011_dev *uart, struct iov_iter *to,
+        size_t len)
+{
+    void *p = NULL;
+    size_t copied=0, n=0, c=0;
+    while( len && (n = embb_ring_peek(&uart->r_ring, &p)) )
+    {
+        n = min(n, len);
+        c = copy_to_iter(p, n, to);
+        embb_ring_commit(&uart->r_ring, c);
+        copied += c;
+        len -= c;
+        if(c < n)
+            break;
+    }
+    return copied;
+}
+
+/* One frame per read, the part that does not fit in @to is dropped */
+static int pl011_read_frame(pl011_dev *uart, struct iov_iter *to,
+        size_t *copied)
+{
+    int flen = embb_ring_rec_len(&uart->r_ring);
+    size_t want = 0;
+    if(flen < 0)
+        return 0;
+    embb_ring_commit(&uart->r_ring, sizeof(u16));
+    want = min_t(size_t, iov_iter_count(to), flen);
+    *copied = pl011_ring_to_iter(uart, to, want);
+    embb_ring_commit(&uart->r_ring, flen - *copied);
+    return *copied < want && !*copied ? -EFAULT : 0;
+}
+
+/* Fan-out read from the shared ring behind the file's cursor. The bottom half
+ * does not wait for us, so the head is checked again after copying and a copy
+ * that may have been overwritten meanwhile is taken back and counted as lost.
+ */
+static ssize_t pl011_fanout_read(pl011_file *pf, struct iov_iter *to)
+{
+    pl011_dev *uart = pf->uart;
+    unsigned long head=0, tail=0;
+    size_t n=0, off=0, first=0, copied=0;
+    for(;;)
+    {
+        head = smp_load_acquire(&uart->fo_head);
+        if( head - pf->tail > FANOUT_WINDOW )
+        {
+            pf->lost += head - FANOUT_WINDOW - pf->tail;
+            pf->tail = head - FANOUT_WINDOW;
+        }
+        tail = pf->tail;
+        n = min_t(size_t, head - tail, iov_iter_count(to));
+        off = tail & (FANOUT_SZ-1);
+        first = min_t(size_t, n, FANOUT_SZ - off);
+        copied = copy_to_iter(uart->fo_buf + off, first, to);
+        if(copied == first)
+            copied += copy_to_iter(uart->fo_buf, n - first, to);
+        //the copy is done before the head is looked at again
+        smp_rmb();
+        if( READ_ONCE(uart->fo_head) - tail <= FANOUT_WINDOW )
+            break;
+        iov_iter_revert(to, copied);
+    }
+    if(n && !copied)
+        return -EFAULT;
+    pf->tail = tail + copied;
+    return copied;
+}
+
+/* Like SO_BUSY_POLL: spins on FR for up to busy_us draining the FIFO from
+ * the reader's context, so the answer does not wait for IRQ, work item and
+ * wakeup. True once this file has something to read.
+ */
+static bool pl011_busy_poll(pl011_file *pf)
+{
+    pl011_dev *uart = pf->uart;
+    u64 end = ktime_get_ns() + (u64)pf->busy_us * NSEC_PER_USEC;
+    do
+    {
+        if( !(pl011_rd(uart, PL011_FR) & PL011_FR_RXFE) )
+            pl011_rx_drain(uart, true);
+        if( !pl011_file_empty(pf) )
+            return true;
+        if( need_resched() || signal_pending(current) )
+            break;
+        cpu_relax();
+    } while( ktime_get_ns() < end );
+    return !pl011_file_empty(pf);
+}
+
+static void pl011_lat_account(pl011_file *pf, u64 t0)
+{
+    u64 us;
+    unsigned int i;
+    if(!t0)
+        return;
+    us = div_u64(ktime_get_ns() - t0, NSEC_PER_USEC);
+    i = us ? min_t(unsigned int, fls64(us), PL011_LAT_BUCKETS-1) : 0;
+    pf->lat[i]++;
+}
+
+/* read(), readv(), io_uring reads and splice(). The iovec (or the pipe) is
+ * filled straight from r_ring; with IOCB_NOWAIT neither the semaphore nor
+ * the data is waited for.
+ */
+static ssize_t pl011_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    pl011_file *pf = (pl011_file *)iocb->ki_filp->private_data;
+    pl011_dev* uart = pf->uart;
+    //r_ring readers share the device, fan-out readers only their cursor
+    struct semaphore *sem = fanout ? &pf->sem : &uart->sem;
+    bool nowait = pl011_nowait(iocb);
+    ssize_t err=0;
+    size_t copied=0;
+    u64 t0;
+    bool polled=false;
+    if( !iov_iter_count(to) )
+        return 0;
+    /* sleeps if no data in r_ring, wakes up if any data has appeared */
+    if(nowait ? down_trylock(sem) : down_interruptible(sem))
+        return nowait ? -EAGAIN : -ERESTARTSYS;
+    //blocking readers also wait for their coalescing threshold
+    while( nowait ? pl011_file_empty(pf) : !pl011_file_ready(pf) )
+    {
+        /* process is about to block */
+        struct pl011_waiter w = { .pf = pf };
+        up(sem);
+        if(nowait)
+            return -EAGAIN;
+        //one busy-poll round per read, then sleep
+        if( pf->busy_us && !polled )
+        {
+            polled = true;
+            if( pl011_busy_poll(pf) )
+            {
+                if( down_interruptible(sem) )
+                    return -ERESTARTSYS;
+                continue;
+            }
+        }
+        init_wait(&w.wq);
+        w.wq.func = pl011_wake_fn;
+        prepare_to_wait(&uart->rqh, &w.wq, TASK_INTERRUPTIBLE);
+        if( !pl011_file_ready(pf) )
+        {
+            //leftovers of the last read have no deadline running yet
+            if( !pl011_file_empty(pf) )
+                pl011_wake_arm(pf);
+            schedule();
+        }
+        finish_wait(&uart->rqh, &w.wq);
+        /* necessary for Ctrl-C to work properly */
+        if(signal_pending(current))
+            return -ERESTARTSYS;
+        if( down_interruptible(sem) )
+            return -ERESTARTSYS;
+    }
+    //the histogram counts from when the first byte handed out came in
+    t0 = pl011_arrival(uart, fanout ? pf->tail : uart->r_ring.tail);
+    //what this read leaves behind starts a new batch
+    if( pf->wake_bytes )
+    {
+        hrtimer_try_to_cancel(&pf->wake_timer);
+        WRITE_ONCE(pf->wake_due, false);
+    }
+    if(fanout)
+    {
+        err = pl011_fanout_read(pf, to);
+        if(err > 0)
+        {
+            iocb->ki_pos += err;
+            pl011_lat_account(pf, t0);
+        }
+        up(sem);
+        return err;
+    }
+    /* sem is kept: r_ring allows only one reader at a time. Hand over as much
+     * as the caller asked for, one read per buffer rather than per word */
+    if(uart->framing != PL011_FRAME_RAW)
+        err = pl011_read_frame(uart, to, &copied);
+    else if( !(copied = pl011_ring_to_iter(uart, to, iov_iter_count(to))) )
+        err = -EFAULT;
+    if(err)
+        goto out;
+    pl011_rx_rearm(uart);
+    //the bottom half stops when r_ring is full, restart it on free room
+    if( !(pl011_rd(uart, PL011_FR) & PL011_FR_RXFE) )
+        schedule_work(&uart->r_work.wrk);
+    //success
+    err = copied;
+    iocb->ki_pos += copied;
+    pl011_lat_account(pf, t0);
+out:
+    up(sem);
+    return err;
+}
+
+/* Sleeps until the TX FIFO has room, the TX interrupt wakes us. The timeout
+ * only covers a lost interrupt. */
+static int pl011_tx_wait_room(pl011_dev *uart)
+{
+    long ret = wait_event_interruptible_timeout(uart->wqh,
+            !(pl011_rd(uart, PL011_FR) & PL011_FR_TXFF), HZ/10);
+    return ret < 0 ? ret : 0;
+}
+
+/* Until the last character left the shift register. There is no interrupt
+ * for that, but below the trigger level it is a few character times. */
+static int pl011_tx_wait_empty(pl011_dev *uart)
+{
+    while( (pl011_rd(uart, PL011_FR) & (PL011_FR_TXFE | PL011_FR_BUSY)) !=
+            PL011_FR_TXFE )
+    {
+        if( signal_pending(current) )
+            return -ERESTARTSYS;
+        usleep_range(100, 200);
+    }
+    pl011_pm_rearm(uart);
+    return 0;
+}
+
+/* Pushes out what t_ring and the urgent lane hold, waits until it is gone */
+static int pl011_tx_flush(pl011_dev *uart)
+{
+    pl011_tx_refill(uart);
+    return wait_event_interruptible(uart->wqh,
+            embb_ring_empty(&uart->t_ring) && embb_ring_empty(&uart->u_ring));
+}
+
+static long pl011_tx_drain(pl011_dev *uart)
+{
+    int err = pl011_tx_flush(uart);
+    return err ? err : pl011_tx_wait_empty(uart);
+}
 
-static void pl011_r_work_handler(struct work_struct *work)
+/* Coalescing write(): queues in t_ring, sleeping while it is full (it is
+ * being sent then, it holds more than tx_batch). The batch goes out when it
+ * reaches tx_batch, otherwise tx_timer bounds how long it waits.
+ */
+static ssize_t pl011_write_ring(pl011_dev *uart, struct iov_iter *from,
+        bool nowait)
 {
-    /* tricky way of obtaining the outer class pointer*/
-    pl011_work *work_container = NULL;
-    work_container = container_of(work, struct pl011_work, wrk);
-    pl011_dev *uart = work_container->opaque;
-    //do NOT read if there is no room in fifo
-    if(kfifo_avail(&uart->r_fifo)>=4)
-    {
-        uint32_t tmp = ioread32(PL011_DR(uart->iomem));
-        uint8_t len=0;
-        //left-truncating more than one NULL bytes: 0x00
-        //if first 3 bytes are not null then the last one is always taken
-        for(; len <sizeof(tmp)-1;  len++)
-            if( !((tmp & 0xff<<8*len)>> 8*len) )
+    ssize_t done=0, err=-EAGAIN;
+    unsigned int n=0, got=0;
+    void *p = NULL;
+    if( nowait ? !mutex_trylock(&uart->tx_lock) :
+            mutex_lock_interruptible(&uart->tx_lock) )
+        return nowait ? -EAGAIN : -ERESTARTSYS;
+    while( iov_iter_count(from) )
+    {
+        n = embb_ring_reserve(&uart->t_ring, &p);
+        if(!n)
+        {
+            if(nowait)
+                break;
+            pl011_tx_refill(uart);
+            if( wait_event_interruptible(uart->wqh,
+                    embb_ring_avail(&uart->t_ring, 1)) )
+            {
+                err = -ERESTARTSYS;
                 break;
-        len++;      //how many bytes will be put in fifo
-        kfifo_in(&uart->r_fifo, &tmp,len);
-        //printk(KERN_WARNING "tmp: 0x%08x, real_len: %d, elems: %d, avail: %d\n",
-        //        tmp, len, kfifo_len(&uart->r_fifo), kfifo_avail(&uart->r_fifo));
-        //     kfifo_out(&uart->r_fifo, &c, sizeof(c));
-        wake_up_interruptible(&uart->rqh);
+            }
+            continue;
+        }
+        got = copy_from_iter(p, min_t(size_t, n, iov_iter_count(from)), from);
+        if(!got)
+        {
+            err = -EFAULT;
+            break;
+        }
+        embb_ring_publish(&uart->t_ring, got);
+        done += got;
     }
+    if( embb_ring_len(&uart->t_ring) >= uart->tx_batch )
+        pl011_tx_refill(uart);
+    else if( !embb_ring_empty(&uart->t_ring) &&
+            !hrtimer_active(&uart->tx_timer) )
+        hrtimer_start(&uart->tx_timer, ns_to_ktime(uart->tx_delay_ns),
+                HRTIMER_MODE_REL);
+    mutex_unlock(&uart->tx_lock);
+    return done ? done : err;
 }
 
-static irq_handler_t data_handler(int nb, void *dev_id, struct pt_regs *regs)
+/* Feeds @len bytes from offset @start of the pinned @pages to the FIFO,
+ * sleeping while it is full. Short only on a signal. */
+static size_t pl011_tx_pages(pl011_dev *uart, struct page **pages,
+        size_t start, size_t len)
 {
-    /* the trick: IRQ is turned off but on read it is checked whether
-     * it should be triggered again */
-    pl011_dev *uart = (pl011_dev *) dev_id;
-    iowrite8(0x10, PL011_ICR(uart->iomem));
+    size_t sent=0, off=0, n=0, k=0;
+    const u8 *va = NULL;
+    while(sent < len)
+    {
+        struct page *pg = pages[(start + sent) >> PAGE_SHIFT];
+        off = (start + sent) & ~PAGE_MASK;
+        n = min_t(size_t, len - sent, PAGE_SIZE - off);
+        va = kmap(pg);
+        for(k=0; k < n; )
+        {
+            size_t m = pl011_tx_push(uart, va + off + k, n - k);
+            k += m;
+            if( !m && pl011_tx_wait_room(uart) )
+                break;
+        }
+        kunmap(pg);
+        sent += k;
+        if(k < n)
+            break;
+    }
+    return sent;
+}
+
+/* Large write(): no bounce buffer, the FIFO is fed from the user pages
+ * themselves, TX_PIN_PAGES at a time, and the call returns once the last
+ * byte is on the line. Interrupted, it returns what was sent.
+ */
+static ssize_t pl011_write_pinned(pl011_dev *uart, struct iov_iter *from)
+{
+    struct page *pages[TX_PIN_PAGES];
+    ssize_t done=0, got=0;
+    size_t start=0, sent=0;
+    int i=0;
+    while( iov_iter_count(from) )
+    {
+        got = iov_iter_get_pages(from, pages, iov_iter_count(from),
+                TX_PIN_PAGES, &start);
+        if(got <= 0)
+            break;
+        sent = pl011_tx_pages(uart, pages, start, got);
+        for(i=0; i < DIV_ROUND_UP(start + got, PAGE_SIZE); i++)
+            put_page(pages[i]);
+        iov_iter_advance(from, sent);
+        done += sent;
+        if(sent < got)
+            return done ? done : -ERESTARTSYS;
+    }
+    if(!done)
+        return got < 0 ? got : -EFAULT;
+    pl011_tx_wait_empty(uart);
+    return done;
+}
+
+/* write(), writev() and io_uring writes. Characters go to the TX FIFO one
+ * hardware FIFO load at a time; a blocking write sleeps on wqh while the
+ * FIFO is full until all of it is queued, IOCB_NOWAIT queues what fits and returns -EAGAIN if that is nothing.
+ * Blocking writes of TX_PIN_MIN and more go through pl011_write_pinned(),
+ * with TX coalescing on smaller ones through pl011_write_ring().
+ */
+static ssize_t pl011_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    pl011_dev* uart = file_uart(iocb->ki_filp);
+    bool nowait = pl011_nowait(iocb);
+    u8 buf[PL011_FIFO_SZ];
+    ssize_t done=0;
+    size_t n=0, pushed=0;
+    bool batch = READ_ONCE(uart->tx_batch);
+    //the self-test's PRBS stream is on the line
+    if( READ_ONCE(uart->selftest) )
+        return -EBUSY;
+    if( batch && iov_iter_count(from) < TX_PIN_MIN )
+    {
+        done = pl011_write_ring(uart, from, nowait);
+        if(done > 0)
+            iocb->ki_pos += done;
+        return done;
+    }
+    //what was batched goes out before
+    if( batch && (nowait ? !embb_ring_empty(&uart->t_ring) :
+            pl011_tx_flush(uart)) )
+        return nowait ? -EAGAIN : -ERESTARTSYS;
+    //user memory only, kernel_write() and splice hand over kvec/bvec
+    if( tx_pin && !nowait && iter_is_iovec(from) &&
+            iov_iter_count(from) >= TX_PIN_MIN )
+    {
+        done = pl011_write_pinned(uart, from);
+        if(done > 0)
+            iocb->ki_pos += done;
+        return done;
+    }
+    while( iov_iter_count(from) )
+    {
+        n = copy_from_iter(buf, min(sizeof(buf), iov_iter_count(from)), from);
+        if(!n)
+            return done ? done : -EFAULT;
+        pushed = pl011_tx_push(uart, buf, n);
+        //FIFO full: sleep until the TX interrupt says there is room
+        while( pushed < n && !nowait && !pl011_tx_wait_room(uart) )
+            pushed += pl011_tx_push(uart, buf+pushed, n-pushed);
+        done += pushed;
+        if(pushed < n)
+        {
+            //give back what the FIFO did not take
+            iov_iter_revert(from, n-pushed);
+            break;
+        }
+    }
+    //nothing queued: no room, or a signal while waiting for it
+    if(!done && iov_iter_count(from))
+        return nowait ? -EAGAIN : -ERESTARTSYS;
+    iocb->ki_pos += done;
+    return done;
+}
+
+/* Moves RX time stamp records to user space, without blocking */
+static long pl011_get_stamps(pl011_dev *uart, struct pl011_stamps __user *arg)
+{
+    struct pl011_stamps req;
+    unsigned int copied=0;
+    long err=0;
+    if( copy_from_user(&req, arg, sizeof(req)) )
+        return -EFAULT;
+    if( down_interruptible(&uart->sem) )
+        return -ERESTARTSYS;
+    err = kfifo_to_user(&uart->ts_fifo, u64_to_user_ptr(req.buf),
+            (unsigned long)req.max * sizeof(struct pl011_rx_stamp), &copied);
+    up(&uart->sem);
+    if(err)
+        return err;
+    req.count = copied / sizeof(struct pl011_rx_stamp);
+    if( put_user(req.count, &arg->count) )
+        return -EFAULT;
+    return 0;
+}
+
+/* RX interrupts are masked and the bottom half is flushed so that nothing
+ * is decoded while buffers are reset under the new mode. */
+static long pl011_set_framing(pl011_dev *uart, int mode)
+{
+    u32 imsc;
+    if( mode < PL011_FRAME_RAW || mode > PL011_FRAME_LEN16 )
+        return -EINVAL;
+    if( down_interruptible(&uart->sem) )
+        return -ERESTARTSYS;
+    imsc = pl011_rd(uart, PL011_IMSC);
+    pl011_wr(uart, PL011_IMSC, imsc & ~(PL011_INT_RX | PL011_INT_RT));
+    cancel_work_sync(&uart->r_work.wrk);
+    mutex_lock(&uart->rx_lock);         //busy pollers
+    embb_ring_reset(&uart->r_ring);
+    pl011_frame_reset(uart);
+    uart->framing = mode;
+    mutex_unlock(&uart->rx_lock);
+    pl011_wr(uart, PL011_IMSC, imsc);
+    up(&uart->sem);
+    //characters that came in meanwhile
     schedule_work(&uart->r_work.wrk);
-    return IRQ_HANDLED;
+    return 0;
 }
 
-static int pl011_open(struct inode *inode, struct file *filep)
+/* Attaches, replaces or (len 0) detaches the RX filter. The old program is
+ * destroyed once the bottom half cannot be running it any more. */
+static long pl011_set_rx_filter(pl011_dev *uart, struct sock_fprog __user *arg)
 {
-    /* called on first access when filep->f_count==0 */
-    pl011_dev *uart = container_of( inode->i_cdev, struct pl011_dev, chrdev);
-    filep->private_data = uart;
-    filep->f_pos=0;
-    //setting IRQ
+    struct sock_fprog fprog;
+    struct bpf_prog *prog = NULL, *old;
     int err=0;
-    err = request_irq(irq_nb, (irq_handler_t) data_handler, 0,
-            "pl011_uart", uart);
-    if( IS_ERR(err) )
+    if( copy_from_user(&fprog, arg, sizeof(fprog)) )
+        return -EFAULT;
+    if(fprog.len)
     {
-        printk(KERN_WARNING "request_irq() failed\n");
-        goto out;
+        //checked like a socket filter, copied from user space
+        err = bpf_prog_create_from_user(&prog, &fprog, NULL, false);
+        if(err)
+            return err;
     }
-    init_waitqueue_head(&uart->rqh);
-    sema_init(&uart->sem, 1);           //one down() possible
-    //spin_lock_init(&uart->flag_lock);
-    iowrite8(0x10, PL011_LCR(uart->iomem));    //enable FIFO
-    smp_wmb();
-    //uart->irq_pending=0;
-    enable_irq(irq_nb);
-    iowrite8(0x70, PL011_IMSC(uart->iomem));    //enable IRQs
-    printk(KERN_WARNING "open(), pos: %llu\n", filep->f_pos);
-out:
-    return err;
+    mutex_lock(&uart->rx_lock);
+    if( prog && !uart->rx_skb &&
+            !(uart->rx_skb = alloc_skb(PL011_FRAME_MAX, GFP_KERNEL)) )
+    {
+        mutex_unlock(&uart->rx_lock);
+        bpf_prog_destroy(prog);
+        return -ENOMEM;
+    }
+    old = uart->rx_filter;
+    uart->rx_filter = prog;
+    mutex_unlock(&uart->rx_lock);
+    if(old)
+        bpf_prog_destroy(old);
+    return 0;
 }
 
-static int pl011_release(struct inode *inode, struct file *filep)
+/* Replaces the RX eventfd, the old one is released outside the lock */
+static long pl011_set_rx_eventfd(pl011_dev *uart,
+        struct pl011_rx_eventfd __user *arg)
 {
-    pl011_dev* uart = (pl011_dev*) filep->private_data;
-    iowrite8(0x00, PL011_IMSC(uart->iomem));
-    disable_irq(irq_nb);
-    free_irq(irq_nb, uart);
-    printk(KERN_WARNING "release()\n");
+    struct pl011_rx_eventfd req;
+    struct eventfd_ctx *ctx = NULL;
+    unsigned long flags;
+    if( copy_from_user(&req, arg, sizeof(req)) )
+        return -EFAULT;
+    if(req.fd >= 0)
+    {
+        ctx = eventfd_ctx_fdget(req.fd);
+        if( IS_ERR(ctx) )
+            return PTR_ERR(ctx);
+    }
+    spin_lock_irqsave(&uart->flag_lock, flags);
+    swap(uart->rx_efd, ctx);
+    uart->rx_mark = clamp_t(u32, req.watermark, 1, RBUFF_SZ);
+    uart->rx_armed = true;
+    //data may already be above the new mark
+    if( uart->rx_efd && embb_ring_len(&uart->r_ring) >= uart->rx_mark )
+    {
+        uart->rx_armed = false;
+        eventfd_signal(uart->rx_efd, 1);
+    }
+    spin_unlock_irqrestore(&uart->flag_lock, flags);
+    if(ctx)
+        eventfd_ctx_put(ctx);
     return 0;
 }
 
-static ssize_t pl011_read(struct file *filep, char __user *data, size_t sz,
-        loff_t *fpos)
+/* Returns and clears the bytes this fan-out reader lost */
+static long pl011_get_lost(pl011_file *pf, __u64 __user *arg)
 {
-    /* normally fpos has to be updated to have a correct filep->f_pos
-     * at next call but this is not used now yet */
-    pl011_dev* uart = (pl011_dev*)filep->private_data;
-    int err=0;
-    /* sleeps if no data in kfifo, wakes up if any data has appeared */
-    down_interruptible(&uart->sem);
-    while(kfifo_is_empty(&uart->r_fifo))
+    u64 lost=0;
+    if( down_interruptible(&pf->sem) )
+        return -ERESTARTSYS;
+    lost = pf->lost;
+    pf->lost = 0;
+    up(&pf->sem);
+    return put_user(lost, arg);
+}
+
+/* PRBS15, x^15 + x^14 + 1, eight bits per call */
+static u8 pl011_prbs_next(u16 *lfsr)
+{
+    u8 out=0;
+    int i=0;
+    for(; i<8; i++)
+    {
+        u16 bit = ((*lfsr >> 14) ^ (*lfsr >> 13)) & 1;
+        *lfsr = ((*lfsr << 1) | bit) & 0x7fff;
+        out = (out << 1) | bit;
+    }
+    return out;
+}
+
+/* Checks one received byte against the sequence, resyncs over drops */
+static void pl011_prbs_check(struct pl011_selftest *st, u16 *lfsr, u8 c)
+{
+    u16 look = *lfsr, probe;
+    u8 want = pl011_prbs_next(&look);
+    size_t k=1;
+    st->rx_bytes++;
+    if(c != want)
+    {
+        for(probe = look; k <= PL011_FIFO_SZ; k++)
+            if( pl011_prbs_next(&probe) == c )
+                break;
+        if(k <= PL011_FIFO_SZ)
+        {
+            st->dropped += k;
+            look = probe;
+        }
+        else
+            st->bit_errors += hweight8(c ^ want);
+    }
+    *lfsr = look;
+}
+
+/* Loopback self-test, see struct pl011_selftest. Runs in the caller's
+ * context polling both FIFOs; RX interrupts and the bottom half are off and
+ * the reader semaphore is held so no other path touches DR meanwhile.
+ */
+static long pl011_selftest(pl011_dev *uart, struct pl011_selftest __user *arg)
+{
+    struct pl011_selftest st;
+    u16 tx_lfsr = PRBS_SEED, rx_lfsr = PRBS_SEED;
+    u8 tbuf[PL011_FIFO_SZ], rbuf[PL011_FIFO_SZ];
+    size_t tn=0, toff=0, n=0, i=0;
+    unsigned long deadline;
+    ktime_t t0, t1;
+    u32 imsc, cr;
+    long err=0;
+    if( copy_from_user(&st, arg, sizeof(st)) )
+        return -EFAULT;
+    if(!st.len)
+        return -EINVAL;
+    st.tx_bytes = st.rx_bytes = st.bit_errors = st.dropped = 0;
+    st.timeout_ms = min_t(u32, st.timeout_ms ? st.timeout_ms : 1000,
+            SELFTEST_MAX_MS);
+    //nobody may open or write the port while the test owns it
+    mutex_lock(&uart->open_lock);
+    if( uart->users != 1 || uart->selftest )
+    {
+        mutex_unlock(&uart->open_lock);
+        return -EBUSY;
+    }
+    uart->selftest = true;
+    mutex_unlock(&uart->open_lock);
+    if( down_interruptible(&uart->sem) )
+    {
+        err = -ERESTARTSYS;
+        goto out_owned;
+    }
+    //queued or batched TX would loop back as bit errors
+    err = pl011_tx_flush(uart);
+    hrtimer_cancel(&uart->tx_timer);
+    if( !err )
+        err = pl011_tx_wait_empty(uart);
+    if(err)
     {
-        /* process is about to block */
-        DEFINE_WAIT(rqe);                   //defines struct wait_queue_t rqe
         up(&uart->sem);
-        prepare_to_wait(&uart->rqh, &rqe, TASK_INTERRUPTIBLE);
-          if(kfifo_is_empty(&uart->r_fifo))
-            schedule();
-        finish_wait(&uart->rqh, &rqe);
-        /* necessary for Ctrl-C to work properly */
-        if(signal_pending(current))
-            return -ERESTARTSYS;
-        down_interruptible(&uart->sem);
+        goto out_owned;
     }
-    up(&uart->sem);
-    /* no read is sleeping now */
-    //get the data from fifo
-    size_t read_sz = kfifo_len(&uart->r_fifo);
-    read_sz = read_sz>4 ? 4 : read_sz;
-    uint32_t tmp =0;
-    kfifo_out(&uart->r_fifo, &tmp, read_sz);
-    //printk(KERN_WARNING "read:sz %d\n", read_sz);
-    if( copy_to_user((uint32_t *)data, &tmp, read_sz) )
+    imsc = pl011_rd(uart, PL011_IMSC);
+    pl011_wr(uart, PL011_IMSC, 0);
+    cancel_work_sync(&uart->r_work.wrk);
+    mutex_lock(&uart->rx_lock);         //busy pollers
+    cr = pl011_rd(uart, PL011_CR);
+    pl011_wr(uart, PL011_CR, cr | PL011_CR_LBE);
+    while( pl011_rx_pull(uart, rbuf, sizeof(rbuf)) )
+        ;                               //stale characters
+    deadline = jiffies + msecs_to_jiffies(st.timeout_ms);
+    t0 = t1 = ktime_get();
+    while( st.rx_bytes + st.dropped < st.len && time_before(jiffies, deadline) )
     {
-        err = -EFAULT;
-        goto out;
+        if( toff == tn && st.tx_bytes < st.len )
+        {
+            tn = min_t(size_t, sizeof(tbuf), st.len - st.tx_bytes);
+            for(i=0; i<tn; i++)
+                tbuf[i] = pl011_prbs_next(&tx_lfsr);
+            toff = 0;
+        }
+        n = pl011_tx_push(uart, tbuf + toff, tn - toff);
+        toff += n;
+        st.tx_bytes += n;
+        n = pl011_rx_pull(uart, rbuf, sizeof(rbuf));
+        for(i=0; i<n; i++)
+            pl011_prbs_check(&st, &rx_lfsr, rbuf[i]);
+        if(n)
+            t1 = ktime_get();
+        else
+            cond_resched();
     }
-    //success
-    err = read_sz;
-    *fpos += read_sz;
-out:
+    st.elapsed_ns = ktime_to_ns(ktime_sub(t1, t0));
+    if(st.tx_bytes > st.rx_bytes + st.dropped)
+        st.dropped = st.tx_bytes - st.rx_bytes;
+    //back to normal operation, late test characters are thrown away
+    while( !(pl011_rd(uart, PL011_FR) & PL011_FR_TXFE) &&
+            time_before(jiffies, deadline + HZ/10) )
+        cond_resched();
+    while( pl011_rx_pull(uart, rbuf, sizeof(rbuf)) )
+        ;
+    pl011_wr(uart, PL011_CR, cr);
+    pl011_wr(uart, PL011_ICR, PL011_INT_ALL);
+    pl011_wr(uart, PL011_IMSC, imsc);
+    mutex_unlock(&uart->rx_lock);
     up(&uart->sem);
+    if( copy_to_user(arg, &st, sizeof(st)) )
+        err = -EFAULT;
+out_owned:
+    mutex_lock(&uart->open_lock);
+    uart->selftest = false;
+    mutex_unlock(&uart->open_lock);
     return err;
 }
 
-static ssize_t pl011_write(struct file *filep, const char __user *udata,
-        size_t sz, loff_t *fpos)
+/* Copies and clears this file's read latency histogram */
+static long pl011_get_lat_hist(pl011_file *pf, struct pl011_lat_hist __user *arg)
+{
+    struct semaphore *sem = fanout ? &pf->sem : &pf->uart->sem;
+    struct pl011_lat_hist h;
+    if( down_interruptible(sem) )
+        return -ERESTARTSYS;
+    memcpy(h.bucket, pf->lat, sizeof(h.bucket));
+    memset(pf->lat, 0, sizeof(pf->lat));
+    up(sem);
+    return copy_to_user(arg, &h, sizeof(h)) ? -EFAULT : 0;
+}
+
+static long pl011_set_rx_coalesce(pl011_file *pf,
+        struct pl011_rx_coalesce __user *arg)
+{
+    struct pl011_rx_coalesce c;
+    if( copy_from_user(&c, arg, sizeof(c)) )
+        return -EFAULT;
+    //without a deadline a lone byte could wait forever
+    if( c.bytes && !c.usecs )
+        return -EINVAL;
+    hrtimer_cancel(&pf->wake_timer);
+    pf->wake_us = c.usecs;
+    WRITE_ONCE(pf->wake_due, false);
+    WRITE_ONCE(pf->wake_bytes, c.bytes);
+    //a reader asleep on the old setting checks again
+    wake_up_interruptible(&pf->uart->rqh);
+    return 0;
+}
+
+static long pl011_set_tx_coalesce(pl011_dev *uart,
+        struct pl011_tx_coalesce __user *arg)
 {
-    /* writes characters to the device */
+    struct pl011_tx_coalesce c;
     int err=0;
-    pl011_dev* uart = (pl011_dev*)filep->private_data;
-    //control how much you write before buffer rewind
-    if( sz > WBUFF_SZ - filep->f_pos )
-        sz = WBUFF_SZ - filep->f_pos; 
-    //write the data from the last write end
-    unsigned char *start = uart->w_buff + filep->f_pos;
-    if( copy_from_user(start, udata, sz) )
+    if( copy_from_user(&c, arg, sizeof(c)) )
+        return -EFAULT;
+    //a full t_ring has to be over the threshold, or nothing would send it
+    if( c.bytes > TBUFF_SZ/2 || (c.bytes && !c.usecs) )
+        return -EINVAL;
+    if( mutex_lock_interruptible(&uart->tx_lock) )
+        return -ERESTARTSYS;
+    //what was batched under the old setting goes out first
+    err = pl011_tx_flush(uart);
+    if(!err)
     {
-        err = -EFAULT;
-        goto out;
+        uart->tx_delay_ns = (u64)c.usecs * NSEC_PER_USEC;
+        WRITE_ONCE(uart->tx_batch, c.bytes);
     }
-    //update file position after write
-    *fpos = (*fpos+sz)%RBUFF_SZ;
-    err = sz;
-    size_t i=0;
-    for(; i<sz; i++)
-        iowrite8(*(start+i), PL011_DR(uart->iomem) );
-out:
+    mutex_unlock(&uart->tx_lock);
     return err;
 }
 
+/* Queues the bytes on the urgent lane and sends what the FIFO takes now,
+ * the TX interrupt pushes the rest ahead of any bulk data */
+static long pl011_send_urgent(pl011_dev *uart,
+        struct pl011_tx_urgent __user *arg)
+{
+    struct pl011_tx_urgent u;
+    unsigned long flags;
+    bool queued;
+    if( copy_from_user(&u, arg, sizeof(u)) )
+        return -EFAULT;
+    if( !u.len || u.len > PL011_URGENT_MAX )
+        return -EINVAL;
+    if( READ_ONCE(uart->selftest) )
+        return -EBUSY;
+    spin_lock_irqsave(&uart->u_lock, flags);
+    queued = embb_ring_avail(&uart->u_ring, u.len) >= u.len;
+    if(queued)
+        embb_ring_in(&uart->u_ring, u.data, u.len);
+    spin_unlock_irqrestore(&uart->u_lock, flags);
+    if(!queued)
+        return -EAGAIN;
+    pl011_urgent_push(uart);
+    return 0;
+}
+
+static long pl011_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    pl011_dev* uart = file_uart(filep);
+    int mode=0;
+    //cmd numbers specified in pl011_uart.h
+    if( _IOC_TYPE(cmd) != PL011_CMD_MAGIC || _IOC_NR(cmd) > PL011_CMD_MAXNR )
+        return -ENOTTY;
+    switch(cmd)
+    {
+    case PL011_GET_STAMPS:
+        return pl011_get_stamps(uart, (struct pl011_stamps __user *)arg);
+    case PL011_SET_FRAMING:
+        if( get_user(mode, (int __user *)arg) )
+            return -EFAULT;
+        //fan-out is a raw byte stream
+        if(fanout)
+            return -EINVAL;
+        return pl011_set_framing(uart, mode);
+    case PL011_SET_RX_EVENTFD:
+        //the watermark is on r_ring, per-reader levels are not tracked
+        if(fanout)
+            return -EINVAL;
+        return pl011_set_rx_eventfd(uart, (struct pl011_rx_eventfd __user *)arg);
+    case PL011_GET_LOST:
+        return pl011_get_lost(filep->private_data, (__u64 __user *)arg);
+    case PL011_SELFTEST:
+        return pl011_selftest(uart, (struct pl011_selftest __user *)arg);
+    case PL011_SET_BUSY_POLL:
+    {
+        u32 us;
+        if( get_user(us, (__u32 __user *)arg) )
+            return -EFAULT;
+        if(us > BUSY_POLL_MAX_US)
+            return -EINVAL;
+        ((pl011_file *)filep->private_data)->busy_us = us;
+        return 0;
+    }
+    case PL011_SET_POLL:
+    {
+        u32 us;
+        if( get_user(us, (__u32 __user *)arg) )
+            return -EFAULT;
+        return pl011_set_poll(uart, us);
+    }
+    case PL011_GET_LAT_HIST:
+        return pl011_get_lat_hist(filep->private_data,
+                (struct pl011_lat_hist __user *)arg);
+    case PL011_SET_RX_COALESCE:
+        return pl011_set_rx_coalesce(filep->private_data,
+                (struct pl011_rx_coalesce __user *)arg);
+    case PL011_SET_RX_FILTER:
+        return pl011_set_rx_filter(uart, (struct sock_fprog __user *)arg);
+    case PL011_SET_TX_COALESCE:
+        return pl011_set_tx_coalesce(uart,
+                (struct pl011_tx_coalesce __user *)arg);
+    case PL011_TX_DRAIN:
+        return pl011_tx_drain(uart);
+    case PL011_TX_URGENT:
+        return pl011_send_urgent(uart, (struct pl011_tx_urgent __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* Readable when r_ring (or the ring behind this file's cursor) holds data.
+ * Writable when the TX FIFO is not full and, with TX coalescing on, t_ring
+ * has room; the TX interrupt wakes wqh as either frees up.
+ */
+static __poll_t pl011_poll(struct file *filep, poll_table *wait)
+{
+    pl011_dev* uart = file_uart(filep);
+    __poll_t mask = 0;
+    poll_wait(filep, &uart->rqh, wait);
+    poll_wait(filep, &uart->wqh, wait);
+    if( !pl011_file_empty(filep->private_data) )
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if( !(pl011_rd(uart, PL011_FR) & PL011_FR_TXFF) &&
+        (!READ_ONCE(uart->tx_batch) ||
+         embb_ring_len(&uart->t_ring) < embb_ring_size(&uart->t_ring)) )
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
 static struct file_operations pl011_fops ={
     .owner = THIS_MODULE,
     .open = pl011_open,
     .release = pl011_release,
-    .read = pl011_read,
-    .write = pl011_write,
+    .read_iter = pl011_read_iter,
+    .write_iter = pl011_write_iter,
+    //splice()/sendfile(): read_iter fills the pipe's pages straight from
+    //the ring, nothing goes through user space
+    .splice_read = generic_file_splice_read,
+    .poll = pl011_poll,
+    .unlocked_ioctl = pl011_ioctl,
+    .fasync = pl011_fasync,
+};
+/* Binds the device to its register backend: either maps the hardware block or
+ * takes the model exported by pl011_model.ko (which has to be loaded first).
+ */
+/* 32 entries from revision 3 (r1p5) on, 16 before, as amba-pl011 has it.
+ * 0 if the block does not identify as a PL011. */
+static unsigned int pl011_fifo_depth(pl011_dev *uart)
+{
+    u32 id0 = pl011_rd(uart, PL011_PERIPHID0) & 0xff;
+    u32 id1 = pl011_rd(uart, PL011_PERIPHID1) & 0x0f;
+    u32 id2 = pl011_rd(uart, PL011_PERIPHID2) & 0xff;
+    if( id0 != 0x11 || id1 != 0 )
+        return 0;
+    return (id2 >> 4) >= 3 ? 32 : 16;
+}
+
+static int pl011_attach_regs(struct pl011_dev *uart)
+{
+    if(use_model)
+    {
+        uart->ops = symbol_get(pl011_model_ops);
+        if( !uart->ops )
+            return -ENODEV;
+        uart->regs = uart->ops->attach();
+        if( !uart->regs )
+        {
+            symbol_put(pl011_model_ops);
+            return -EBUSY;
+        }
+        uart->fifo_sz = PL011_FIFO_SZ;
+        return 0;
+    }
+    uart->io_start = phys_add;
+    uart->io_size = PL011_MEM_SZ;
+    if( !(uart->io_mem_region = request_mem_region(uart->io_start, uart->io_size,
+            "pl011_regs")))
+        return -ENODEV;
+    uart->iomem = ioremap(uart->io_start, uart->io_size);
+    if( !uart->iomem )
+    {
+        release_mem_region(uart->io_start, uart->io_size);
+        return -ENOMEM;
+    }
+    uart->ops = &pl011_hw_ops;
+    uart->regs = uart->iomem;
+    uart->fifo_sz = fifo_sz ? min_t(uint, fifo_sz, PL011_FIFO_SZ) :
+        pl011_fifo_depth(uart);
+    if(!uart->fifo_sz)
+        printk(KERN_WARNING "unknown FIFO depth, bursts follow FR\n");
+    return 0;
+}
+
+static void pl011_detach_regs(struct pl011_dev *uart)
+{
+    if(use_model)
+    {
+        uart->ops->detach(uart->regs);
+        symbol_put(pl011_model_ops);
+    }
+    else
+    {
+        iounmap(uart->iomem);
+        release_mem_region(uart->io_start, uart->io_size);
+    }
+    uart->ops = NULL;
+    uart->regs = NULL;
+}
+
+/* TTY FRONT END:
+ * with tty=1 the port is handed to serial_core as /dev/ttyPL0 so standard
+ * tools and line disciplines work on it. It shares the register backend and
+ * pl011_rx_pull/pl011_tx_push with the cdev, but received characters go
+ * through the tty flip buffers. The raw cdev remains the low overhead path
+ * for binary traffic: one copy from r_ring, no line discipline.
+ * serial_core serialises the uart_ops with port->lock.
+ */
+static struct uart_driver pl011_uart_driver = {
+    .owner = THIS_MODULE,
+    .driver_name = DEV_NAME,
+    .dev_name = "ttyPL",
+    .major = 0,                 //dynamic
+    .minor = 0,
+    .nr = MINOR_NB,
+};
+
+static inline pl011_dev *port_to_uart(struct uart_port *port)
+{
+    return container_of(port, pl011_dev, port);
+}
+
+/* Refills the TX FIFO from the xmit ring, port->lock held */
+static void pl011_tty_tx_chars(pl011_dev *uart)
+{
+    struct uart_port *port = &uart->port;
+    struct circ_buf *xmit = &port->state->xmit;
+    u32 imsc = pl011_rd(uart, PL011_IMSC);
+    while( !uart_circ_empty(xmit) && !uart_tx_stopped(port) )
+    {
+        size_t n = CIRC_CNT_TO_END(xmit->head, xmit->tail, UART_XMIT_SIZE);
+        n = pl011_tx_push(uart, (u8 *)xmit->buf + xmit->tail, n);
+        if(!n)
+            break;
+        xmit->tail = (xmit->tail + n) & (UART_XMIT_SIZE - 1);
+        port->icount.tx += n;
+    }
+    if( uart_circ_chars_pending(xmit) < WAKEUP_CHARS )
+        uart_write_wakeup(port);
+    //the TX interrupt is only wanted while there is something to refill
+    if( uart_circ_empty(xmit) || uart_tx_stopped(port) )
+        imsc &= ~PL011_INT_TX;
+    else
+        imsc |= PL011_INT_TX;
+    pl011_wr(uart, PL011_IMSC, imsc);
+}
+
+static irqreturn_t pl011_tty_irq(int nb, void *dev_id)
+{
+    pl011_dev *uart = (pl011_dev *) dev_id;
+    struct uart_port *port = &uart->port;
+    u8 buf[PL011_FIFO_SZ];
+    size_t n;
+    u32 mis = pl011_rd(uart, PL011_MIS);
+    if(!mis)
+        return IRQ_NONE;
+    pl011_wr(uart, PL011_ICR, mis);
+    spin_lock(&port->lock);
+    if( mis & (PL011_INT_RX | PL011_INT_RT) )
+        while( (n = pl011_rx_pull(uart, buf, sizeof(buf))) )
+        {
+            port->icount.rx += n;
+            tty_insert_flip_string(&port->state->port, buf, n);
+        }
+    if(mis & PL011_INT_OE)
+        port->icount.overrun++;
+    if(mis & PL011_INT_TX)
+        pl011_tty_tx_chars(uart);
+    spin_unlock(&port->lock);
+    tty_flip_buffer_push(&port->state->port);
+    return IRQ_HANDLED;
+}
+
+static unsigned int pl011_tty_tx_empty(struct uart_port *port)
+{
+    u32 fr = pl011_rd(port_to_uart(port), PL011_FR);
+    return (fr & PL011_FR_TXFE) && !(fr & PL011_FR_BUSY) ? TIOCSER_TEMT : 0;
+}
+
+static void pl011_tty_set_mctrl(struct uart_port *port, unsigned int mctrl)
+{
+    //no modem lines wired
+}
+
+static unsigned int pl011_tty_get_mctrl(struct uart_port *port)
+{
+    return TIOCM_CAR | TIOCM_CTS | TIOCM_DSR;
+}
+
+static void pl011_tty_stop_tx(struct uart_port *port)
+{
+    pl011_dev *uart = port_to_uart(port);
+    pl011_wr(uart, PL011_IMSC, pl011_rd(uart, PL011_IMSC) & ~PL011_INT_TX);
+}
+
+static void pl011_tty_start_tx(struct uart_port *port)
+{
+    pl011_tty_tx_chars(port_to_uart(port));
+}
+
+static void pl011_tty_stop_rx(struct uart_port *port)
+{
+    pl011_dev *uart = port_to_uart(port);
+    pl011_wr(uart, PL011_IMSC, pl011_rd(uart, PL011_IMSC) &
+            ~(PL011_INT_RX | PL011_INT_RT));
+}
+
+static void pl011_tty_break_ctl(struct uart_port *port, int ctl)
+{
+}
+
+static int pl011_tty_startup(struct uart_port *port)
+{
+    pl011_dev *uart = port_to_uart(port);
+    pl011_irq_start(uart, pl011_tty_irq);
+    pl011_wr(uart, PL011_ICR, PL011_INT_ALL);
+    if(loopback)
+        pl011_wr(uart, PL011_CR, pl011_rd(uart, PL011_CR) | PL011_CR_LBE);
+    pl011_wr(uart, PL011_IMSC, PL011_INT_RX | PL011_INT_RT | PL011_INT_OE);
+    return 0;
+}
+
+static void pl011_tty_shutdown(struct uart_port *port)
+{
+    pl011_dev *uart = port_to_uart(port);
+    pl011_wr(uart, PL011_IMSC, 0);
+    pl011_irq_stop(uart);
+}
+
+/* Baud rate divisor is UARTCLK/(16*baud) in 16.6 fixed point */
+static void pl011_tty_set_termios(struct uart_port *port,
+        struct ktermios *termios, struct ktermios *old)
+{
+    pl011_dev *uart = port_to_uart(port);
+    unsigned int baud = uart_get_baud_rate(port, termios, old, 0,
+            port->uartclk/16);
+    unsigned int div = DIV_ROUND_CLOSEST(port->uartclk*4, baud);
+    unsigned long flags;
+    u32 lcr = PL011_LCR_FEN;
+    switch(termios->c_cflag & CSIZE)
+    {
+        case CS5: lcr |= PL011_LCR_WLEN5; break;
+        case CS6: lcr |= PL011_LCR_WLEN6; break;
+        case CS7: lcr |= PL011_LCR_WLEN7; break;
+        default: lcr |= PL011_LCR_WLEN8; break;
+    }
+    if(termios->c_cflag & CSTOPB)
+        lcr |= PL011_LCR_STP2;
+    if(termios->c_cflag & PARENB)
+    {
+        lcr |= PL011_LCR_PEN;
+        if( !(termios->c_cflag & PARODD) )
+            lcr |= PL011_LCR_EPS;
+    }
+    spin_lock_irqsave(&port->lock, flags);
+    uart_update_timeout(port, termios->c_cflag, baud);
+    pl011_wr(uart, PL011_IBRD, div >> 6);
+    pl011_wr(uart, PL011_FBRD, div & 0x3f);
+    //LCR_H write latches the divisor
+    pl011_wr(uart, PL011_LCR, lcr);
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+/* serial_core powers the port up before startup and down after shutdown */
+static void pl011_tty_pm(struct uart_port *port, unsigned int state,
+        unsigned int oldstate)
+{
+    pl011_dev *uart = port_to_uart(port);
+    if(state == oldstate)
+        return;
+    if(state == UART_PM_STATE_ON)
+        pl011_power_up(uart);
+    else
+        pl011_power_down(uart);
+}
+
+static const char *pl011_tty_type(struct uart_port *port)
+{
+    return port->type == PORT_AMBA ? "PL011" : NULL;
+}
+
+static void pl011_tty_release_port(struct uart_port *port)
+{
+}
+
+static int pl011_tty_request_port(struct uart_port *port)
+{
+    //registers are claimed once at load time by pl011_attach_regs()
+    return 0;
+}
+
+static void pl011_tty_config_port(struct uart_port *port, int flags)
+{
+    if(flags & UART_CONFIG_TYPE)
+        port->type = PORT_AMBA;
+}
+
+static int pl011_tty_verify_port(struct uart_port *port,
+        struct serial_struct *ser)
+{
+    if( ser->type != PORT_UNKNOWN && ser->type != PORT_AMBA )
+        return -EINVAL;
+    return 0;
+}
+
+static const struct uart_ops pl011_tty_ops = {
+    .tx_empty = pl011_tty_tx_empty,
+    .set_mctrl = pl011_tty_set_mctrl,
+    .get_mctrl = pl011_tty_get_mctrl,
+    .stop_tx = pl011_tty_stop_tx,
+    .start_tx = pl011_tty_start_tx,
+    .stop_rx = pl011_tty_stop_rx,
+    .break_ctl = pl011_tty_break_ctl,
+    .startup = pl011_tty_startup,
+    .shutdown = pl011_tty_shutdown,
+    .set_termios = pl011_tty_set_termios,
+    .pm = pl011_tty_pm,
+    .type = pl011_tty_type,
+    .release_port = pl011_tty_release_port,
+    .request_port = pl011_tty_request_port,
+    .config_port = pl011_tty_config_port,
+    .verify_port = pl011_tty_verify_port,
 };
+
+static int pl011_tty_construct(pl011_dev *uart)
+{
+    struct uart_port *port = &uart->port;
+    int err = pl011_attach_regs(uart);
+    if(err)
+        goto fail_regs;
+    //pl011_tx_push, tx_refill and power_down are shared with the char
+    //device and look at both rings, which just stay empty here
+    if( (err=embb_ring_init(&uart->t_ring, TBUFF_SZ, GFP_KERNEL)) )
+        goto fail_t_ring;
+    if( (err=embb_ring_init(&uart->u_ring, UBUFF_SZ, GFP_KERNEL)) )
+        goto fail_u_ring;
+    init_waitqueue_head(&uart->wqh);
+    spin_lock_init(&uart->tx_slock);
+    spin_lock_init(&uart->u_lock);
+    err = uart_register_driver(&pl011_uart_driver);
+    if(err)
+        goto fail_register;
+    port->ops = &pl011_tty_ops;
+    port->iotype = UPIO_MEM;
+    port->mapbase = use_model ? 0 : phys_add;
+    port->membase = uart->iomem;
+    port->irq = use_model ? 0 : irq_nb;
+    port->fifosize = uart->fifo_sz ? uart->fifo_sz : 16;
+    port->uartclk = uartclk;
+    port->type = PORT_AMBA;
+    port->flags = UPF_FIXED_TYPE;
+    port->line = MINOR_FIRST;
+    err = uart_add_one_port(&pl011_uart_driver, port);
+    if(err)
+        goto fail_add_port;
+    return 0;
+fail_add_port:
+    uart_unregister_driver(&pl011_uart_driver);
+fail_register:
+    embb_ring_free(&uart->u_ring);
+fail_u_ring:
+    embb_ring_free(&uart->t_ring);
+fail_t_ring:
+    pl011_detach_regs(uart);
+fail_regs:
+    printk(KERN_WARNING "tty front end failed: %d\n", err);
+    return err;
+}
+
+static void pl011_tty_destroy(pl011_dev *uart)
+{
+    uart_remove_one_port(&pl011_uart_driver, &uart->port);
+    uart_unregister_driver(&pl011_uart_driver);
+    embb_ring_free(&uart->u_ring);
+    embb_ring_free(&uart->t_ring);
+    pl011_detach_regs(uart);
+}
+
 static int pl011_construct_device(struct pl011_dev *uart, struct class *klass)
 {
     int err=0, err_flag=0;
@@ -264,46 +2255,79 @@ static int pl011_construct_device(struct pl011_dev *uart, struct class *klass)
     if(err)
         goto fail_cdev_add;
     //creating entries in: '/dev' and '/sys/dev/char'
-    device = device_create( klass, NULL, devt, NULL /*opaque*/,
+    device = device_create( klass, NULL, devt, uart /*opaque*/,
         DEV_NAME "%d", MINOR_FIRST);
     if( IS_ERR(device) )
         goto fail_dev_create;
     // device internal logic setup
-    if( !(uart->w_buff = kzalloc( WBUFF_SZ, GFP_KERNEL)))
-        goto fail_w_buff;
-    uart->io_start = PL011_PHYS_ADD;
-    uart->io_size = PL011_MEM_SZ;
-    if( !(uart->io_mem_region = request_mem_region(uart->io_start, uart->io_size,
-            "pl011_regs")))
+    if( (err=pl011_attach_regs(uart)) )
         goto fail_io_mem_region;
-    uart->iomem = ioremap(uart->io_start, uart->io_size);
-    if( (err=kfifo_alloc(&uart->r_fifo, RBUFF_SZ, GFP_KERNEL)) )
+    if( (err=embb_ring_init(&uart->r_ring, RBUFF_SZ, GFP_KERNEL)) )
+        goto fail_kfifo;
+    if( (err=embb_ring_init(&uart->t_ring, TBUFF_SZ, GFP_KERNEL)) )
+    {
+        embb_ring_free(&uart->r_ring);
+        goto fail_kfifo;
+    }
+    if( (err=embb_ring_init(&uart->u_ring, UBUFF_SZ, GFP_KERNEL)) )
+    {
+        embb_ring_free(&uart->t_ring);
+        embb_ring_free(&uart->r_ring);
+        goto fail_kfifo;
+    }
+    if( (err=kfifo_alloc(&uart->ts_fifo, STAMPS_NB, GFP_KERNEL)) )
+    {
+        embb_ring_free(&uart->u_ring);
+        embb_ring_free(&uart->t_ring);
+        embb_ring_free(&uart->r_ring);
+        goto fail_kfifo;
+    }
+    if( !(uart->f_buff = kzalloc(PL011_FRAME_MAX, GFP_KERNEL)) ||
+        (fanout && !(uart->fo_buf = kzalloc(FANOUT_SZ, GFP_KERNEL))) )
+    {
+        kfree(uart->f_buff);
+        kfifo_free(&uart->ts_fifo);
+        embb_ring_free(&uart->u_ring);
+        embb_ring_free(&uart->t_ring);
+        embb_ring_free(&uart->r_ring);
+        err = -ENOMEM;
         goto fail_kfifo;
+    }
+    spin_lock_init(&uart->flag_lock);
+    init_waitqueue_head(&uart->rqh);
+    init_waitqueue_head(&uart->wqh);
+    sema_init(&uart->sem, 1);           //one down() possible
+    mutex_init(&uart->open_lock);
+    mutex_init(&uart->rx_lock);
+    mutex_init(&uart->tx_lock);
+    spin_lock_init(&uart->tx_slock);
+    spin_lock_init(&uart->u_lock);
+    hrtimer_init(&uart->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    uart->tx_timer.function = pl011_tx_tick;
     INIT_WORK(&uart->r_work.wrk, pl011_r_work_handler);
     uart->r_work.opaque = uart;
+    //powered now, gated once idle for autosuspend_ms
+    uart->dev = device;
+    pm_runtime_set_autosuspend_delay(device, autosuspend_ms);
+    pm_runtime_use_autosuspend(device);
+    pm_runtime_set_active(device);
+    pm_runtime_enable(device);
+    pm_runtime_mark_last_busy(device);
+    pm_request_autosuspend(device);
     //success
     return 0;
     //fail
 fail_kfifo:
     if(!err_flag++)
     {
-        printk(KERN_WARNING "kfifo_alloc() failed\n");
+        printk(KERN_WARNING "RX buffer allocation failed\n");
     }
-    iounmap(uart->iomem);
+    pl011_detach_regs(uart);
 fail_io_mem_region:
     if(!err_flag++)
-    {
-        printk(KERN_WARNING "request_mem_region() failed\n");
-        err = -ENODEV;
-    }
+        printk(KERN_WARNING "%s registers unavailable\n",
+                use_model ? "model" : "hw");
     //kfree(uart->r_buff);
-    kfree(uart->w_buff);
-fail_w_buff:
-    if(!err_flag++)
-    {
-        printk(KERN_WARNING "kzalloc() failed\n");
-        err = -ENOMEM;
-    }
     device_destroy(klass, MKDEV(pl011_major, MINOR_FIRST));
 fail_dev_create:
     if(!err_flag++)
@@ -321,15 +2345,33 @@ fail_cdev_add:
 static int pl011_destroy_device( struct pl011_dev *uart, struct class *klass)
 {
     /* device internal logic cleanup */
+    //leave the port powered up
+    pm_runtime_get_sync(uart->dev);
+    pm_runtime_disable(uart->dev);
+    pm_runtime_dont_use_autosuspend(uart->dev);
+    pm_runtime_put_noidle(uart->dev);
     if( work_pending(&uart->r_work.wrk) )
         flush_scheduled_work();
-    kfifo_free(&uart->r_fifo);
-    iounmap(uart->iomem);
-    release_mem_region(uart->io_start, uart->io_size);
+    if(uart->rx_efd)
+        eventfd_ctx_put(uart->rx_efd);
+    uart->rx_efd = NULL;
+    if(uart->rx_filter)
+        bpf_prog_destroy(uart->rx_filter);
+    uart->rx_filter = NULL;
+    kfree_skb(uart->rx_skb);
+    uart->rx_skb = NULL;
+    kfree(uart->fo_buf);
+    uart->fo_buf = NULL;
+    kfree(uart->f_buff);
+    uart->f_buff = NULL;
+    kfifo_free(&uart->ts_fifo);
+    hrtimer_cancel(&uart->tx_timer);
+    embb_ring_free(&uart->u_ring);
+    embb_ring_free(&uart->t_ring);
+    embb_ring_free(&uart->r_ring);
+    pl011_detach_regs(uart);
     //kfree(uart->r_buff);
     //uart->r_buff = NULL;
-    kfree(uart->w_buff);
-    uart->w_buff = NULL;
     /* kernel structures cleanup */
     device_destroy(klass, MKDEV(pl011_major, MINOR_FIRST));
     cdev_del(&uart->chrdev);
@@ -350,17 +2392,26 @@ static int __init pl011_init(void)
     pl011_class = class_create(THIS_MODULE, DEV_NAME);
     if( IS_ERR(pl011_class) )
         goto fail_class_create;
+    pl011_class->pm = &pl011_pm_ops;
     // allocate the device
     pl011_device = (struct pl011_dev *) kzalloc( sizeof(struct pl011_dev),
             GFP_KERNEL);
     if(!pl011_device)
         goto fail_dev_alloc;
-    //construction of the device with the class
-    err = pl011_construct_device(pl011_device, pl011_class);
+    hrtimer_init(&pl011_device->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    pl011_device->poll_timer.function = pl011_poll_tick;
+    if(poll_us)
+        poll_us = clamp_t(uint, poll_us, POLL_MIN_US, POLL_MAX_US);
+    pl011_device->poll_ns = (u64)poll_us * NSEC_PER_USEC;
+    //construction of the device with the class, or as a tty
+    if(tty)
+        err = pl011_tty_construct(pl011_device);
+    else
+        err = pl011_construct_device(pl011_device, pl011_class);
     if(err)
         goto fail_construct_fun;
     printk(KERN_ALERT "pl011 allocated \n\tnode: /dev/%s\n\tmajor: %d\n",
-            DEV_NAME, pl011_major);
+            tty ? "ttyPL0" : DEV_NAME, pl011_major);
     //success
     return 0;
     //fail
@@ -391,7 +2442,10 @@ fail_chrdev_region:
 
 static void __exit pl011_exit(void)
 {
-    pl011_destroy_device(pl011_device, pl011_class);
+    if(tty)
+        pl011_tty_destroy(pl011_device);
+    else
+        pl011_destroy_device(pl011_device, pl011_class);
     kfree(pl011_device);
     pl011_device=NULL;
     class_destroy(pl011_class);
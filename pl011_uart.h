@@ -2,11 +2,160 @@
 #define PL011_UART_H
 
 #include <linux/ioctl.h>    //not sure if that is a correct file
+#include <linux/types.h>    //__u32, __u64 shared with user space
+#include <linux/filter.h>   //struct sock_fprog
+
+/* One record per RX burst drained by the bottom half. @ts_ns is
+ * CLOCK_MONOTONIC taken in the IRQ handler that announced the burst, @seq is
+ * the stream offset of its first byte (bytes received since the device was
+ * created), so byte N of the stream arrived at the ts_ns of the last record
+ * with seq <= N.
+ */
+struct pl011_rx_stamp
+{
+    __u64 ts_ns;
+    __u64 seq;
+    __u32 len;
+    __u32 flags;
+};
+#define PL011_STAMP_LOST 0x1    //records before this one were dropped
+
+/* PL011_GET_STAMPS: up to @max records are moved to @buf, the number copied
+ * is returned in @count. */
+struct pl011_stamps
+{
+    __u64 buf;                  //struct pl011_rx_stamp *, as u64 for 32/64 bit
+    __u32 max;
+    __u32 count;
+};
+
+/* Framing modes for PL011_SET_FRAMING. With framing on, the driver decodes
+ * frames as it drains the RX FIFO and every read() returns exactly one frame
+ * payload, truncated if the buffer is shorter than the frame. Switching the
+ * mode discards whatever was buffered.
+ * - SLIP: RFC 1055, END 0xc0 closes a frame, ESC 0xdb escapes END/ESC,
+ * - LEN16: a big-endian 16-bit payload length, then the payload.
+ * Empty frames are ignored, frames longer than PL011_FRAME_MAX are dropped.
+ */
+#define PL011_FRAME_RAW 0
+#define PL011_FRAME_SLIP 1
+#define PL011_FRAME_LEN16 2
+#define PL011_FRAME_MAX 1024
+
+/* PL011_SET_RX_EVENTFD: the driver signals eventfd @fd once when the RX
+ * buffer fills up to @watermark bytes (1 if 0) and then stays quiet until a
+ * read() takes it below the mark again, so a consumer wakes up once per batch.
+ * @fd < 0 detaches the eventfd.
+ */
+struct pl011_rx_eventfd
+{
+    __s32 fd;
+    __u32 watermark;
+};
+
+/* PL011_SELFTEST: link check without external gear. The driver sets CR.LBE,
+ * sends @len bytes of PRBS15 and checks what comes back, by polling the
+ * FIFOs with interrupts masked. Needs to be the only open file, readers see
+ * nothing of the test traffic, opens and writes get EBUSY meanwhile. Queued
+ * TX is sent first. Gives up after @timeout_ms (0: 1000, at most 10000).
+ * A byte that does not match but is one of the next 32 expected ones counts
+ * the skipped ones as @dropped, otherwise its wrong bits go to @bit_errors;
+ * bytes sent but not back by the timeout are dropped too.
+ */
+struct pl011_selftest
+{
+    __u32 len;                  //in
+    __u32 timeout_ms;           //in
+    __u64 elapsed_ns;           //out: first TX to last RX
+    __u64 tx_bytes;
+    __u64 rx_bytes;
+    __u64 bit_errors;
+    __u64 dropped;
+};
+
+/* PL011_SET_BUSY_POLL: a read() on this file that finds nothing to return
+ * spins on the flag register and drains the FIFO itself for up to the given
+ * number of microseconds (at most 1000, else EINVAL), then sleeps as usual;
+ * 0 turns it off.
+ * PL011_GET_LAT_HIST: for every successful read on this file, the time from
+ * the RX interrupt that brought its first byte to read() handing it out
+ * (drains without an interrupt count from the drain), bucket 0
+ * is under 1 us, bucket i in [2^(i-1), 2^i) us, the last one open ended.
+ * Reading clears it.
+ */
+#define PL011_LAT_BUCKETS 16
+struct pl011_lat_hist
+{
+    __u32 bucket[PL011_LAT_BUCKETS];
+};
+
+/* PL011_SET_RX_COALESCE: a blocking read() on this file is only woken once
+ * at least @bytes are queued or @usecs passed since it first saw data, so a
+ * busy stream costs one wakeup per batch while a lone byte still arrives in
+ * bounded time. @bytes 0 wakes on every arrival (the default), otherwise
+ * @usecs must not be 0. Non-blocking reads return what is there.
+ */
+struct pl011_rx_coalesce
+{
+    __u32 bytes;
+    __u32 usecs;
+};
 
 #define PL011_CMD_MAGIC 0xed
 //second value is an ordinal number
 //third value is a type
 #define PL011_CMD1 _IOR(PL011_CMD_MAGIC, 1, int) 
+#define PL011_GET_STAMPS _IOWR(PL011_CMD_MAGIC, 2, struct pl011_stamps)
+#define PL011_SET_FRAMING _IOW(PL011_CMD_MAGIC, 3, int)
+#define PL011_SET_RX_EVENTFD _IOW(PL011_CMD_MAGIC, 4, struct pl011_rx_eventfd)
+/* With the module loaded fanout=1 every open file gets the whole RX stream
+ * from the moment it was opened. A reader more than ~16 KiB behind loses the
+ * oldest bytes, PL011_GET_LOST returns (and clears) how many. */
+#define PL011_GET_LOST _IOR(PL011_CMD_MAGIC, 5, __u64)
+#define PL011_SELFTEST _IOWR(PL011_CMD_MAGIC, 6, struct pl011_selftest)
+#define PL011_SET_BUSY_POLL _IOW(PL011_CMD_MAGIC, 7, __u32)
+#define PL011_GET_LAT_HIST _IOR(PL011_CMD_MAGIC, 8, struct pl011_lat_hist)
+/* PL011_SET_POLL: serve the port from an hrtimer every given number of
+ * microseconds (100 to 1000000, else EINVAL) instead of its interrupt line,
+ * 0 goes back to the interrupt. Fails with EIO if the line cannot be had,
+ * the port keeps polling then. */
+#define PL011_SET_POLL _IOW(PL011_CMD_MAGIC, 9, __u32)
+#define PL011_SET_RX_COALESCE _IOW(PL011_CMD_MAGIC, 10, struct pl011_rx_coalesce)
+/* PL011_SET_TX_COALESCE: writes of less than a page are queued in the
+ * driver and sent once @bytes are waiting or @usecs after the first of them,
+ * whichever comes first. @bytes 0 turns it off (the default), at most 2048.
+ * PL011_TX_DRAIN: like tcdrain(), sends what is queued and returns once the
+ * last character left the UART.
+ */
+struct pl011_tx_coalesce
+{
+    __u32 bytes;
+    __u32 usecs;
+};
+
+/* PL011_TX_URGENT: a few bytes (XOFF, abort, ...) that overtake everything
+ * queued by write(): they go to the TX FIFO as soon as it has room and no
+ * bulk data is put in before them, so they only wait for what the hardware
+ * FIFO already holds. All or nothing, EAGAIN while earlier urgent bytes are
+ * still waiting and these do not fit.
+ */
+#define PL011_URGENT_MAX 16
+struct pl011_tx_urgent
+{
+    __u32 len;
+    __u8 data[PL011_URGENT_MAX];
+};
+
+/* PL011_SET_RX_FILTER: a classic BPF program, as for SO_ATTACH_FILTER, run
+ * by the bottom half over every frame (framing modes) or every FIFO load
+ * (raw, fan-out) before it is queued. The packet is the received bytes, the
+ * return value how many of them to keep: 0 drops, less truncates. Dropped
+ * data is never read nor woken for. A program of length 0 detaches. */
+#define PL011_SET_RX_FILTER _IOW(PL011_CMD_MAGIC, 11, struct sock_fprog)
+#define PL011_SET_TX_COALESCE _IOW(PL011_CMD_MAGIC, 12, struct pl011_tx_coalesce)
+#define PL011_TX_DRAIN _IO(PL011_CMD_MAGIC, 13)
+#define PL011_TX_URGENT _IOW(PL011_CMD_MAGIC, 14, struct pl011_tx_urgent)
+#define PL011_CMD_MAXNR 14
 #endif //PL011_UART_H
 
 /*
@@ -36,6 +36,7 @@
 #define PL011_DR(base) (base)
 #define PL011_IMSC(base) PL011_OFFSET( (base), 0x38)
 #define PL011_ICR(base) PL011_OFFSET( (base), 0x44)
+#define PL011_CR(base) PL011_OFFSET( (base), 0x30)
 
 typedef struct pl011_dev
 {
@@ -50,13 +51,20 @@ typedef struct pl011_dev
     int irq_pending;
     spinlock_t flag_lock;
     wait_queue_head_t rqh;      //read queue head
+    struct mutex open_lock;
+    unsigned int open_nb;       //IRQ requested while non zero
 } pl011_dev;
 
 static struct class *pl011_class = NULL;
 static struct pl011_dev *pl011_device = NULL;
 static unsigned int pl011_major=0;
 //access address - is it possible to not make it global?
-static const int irq_nb = 0x3b;
+static int irq_nb = 0x3b;
+static ulong phys_add = PL011_PHYS_ADD;
+static bool loopback = false;           //CR.LBE, for the benchmark
+module_param(irq_nb, int, S_IRUGO);
+module_param(phys_add, ulong, S_IRUGO);
+module_param(loopback, bool, S_IRUGO);
 //size_t uart_id = 0xC0CADEAD;         //used for shared IRQ lines
 
 static irq_handler_t data_handler(int nb, void *dev_id, struct pt_regs *regs)
@@ -78,13 +86,17 @@ static int pl011_open(struct inode *inode, struct file *filep)
     pl011_dev *uart = container_of( inode->i_cdev, struct pl011_dev, chrdev);
     filep->private_data = uart;
     filep->f_pos=0;
-    //setting IRQ
+    //setting IRQ, once for all the files open on the device
     int err=0;
+    mutex_lock(&uart->open_lock);
+    if( uart->open_nb++ )
+        goto out;
     err = request_irq(irq_nb, (irq_handler_t) data_handler, 0,
             "pl011_uart", uart);
-    if( IS_ERR(err) )
+    if(err)
     {
         printk(KERN_WARNING "request_irq() failed\n");
+        uart->open_nb--;
         goto out;
     }
     init_waitqueue_head(&uart->rqh);
@@ -93,17 +105,25 @@ static int pl011_open(struct inode *inode, struct file *filep)
     uart->irq_pending=0;
     enable_irq(irq_nb);
     iowrite8(0x70, PL011_IMSC(uart->iomem));
+    if(loopback)
+        iowrite16(ioread16(PL011_CR(uart->iomem)) | 0x80, PL011_CR(uart->iomem));
     printk(KERN_WARNING "open(), pos: %llu\n", filep->f_pos);
 out:
+    mutex_unlock(&uart->open_lock);
     return err;
 }
 
 static int pl011_release(struct inode *inode, struct file *filep)
 {
     pl011_dev* uart = (pl011_dev*) filep->private_data;
-    iowrite8(0x00, PL011_IMSC(uart->iomem));
-    disable_irq(irq_nb);
-    free_irq(irq_nb, uart);
+    mutex_lock(&uart->open_lock);
+    if( !--uart->open_nb )
+    {
+        iowrite8(0x00, PL011_IMSC(uart->iomem));
+        disable_irq(irq_nb);
+        free_irq(irq_nb, uart);
+    }
+    mutex_unlock(&uart->open_lock);
     printk(KERN_WARNING "release()\n");
     return 0;
 }
@@ -165,7 +185,6 @@ static ssize_t pl011_read(struct file *filep, char __user *data, size_t sz,
         uart->r_get = uart->r_buff;
     //success
     err = 1;
-    *fpos += 1;
 out:
     up(&uart->sem);
     return err;
@@ -177,19 +196,16 @@ static ssize_t pl011_write(struct file *filep, const char __user *udata,
     /* writes characters to the device */
     int err=0;
     pl011_dev* uart = (pl011_dev*)filep->private_data;
-    //control how much you write before buffer rewind
-    if( sz > WBUFF_SZ - filep->f_pos )
-        sz = WBUFF_SZ - filep->f_pos; 
+    //w_buff is a staging area refilled by every call, the file has no offset
+    if( sz > WBUFF_SZ )
+        sz = WBUFF_SZ;
     printk(KERN_WARNING "sz: %d\n", sz);
-    //write the data from the last write end
-    unsigned char *start = uart->w_buff + filep->f_pos;
+    unsigned char *start = uart->w_buff;
     if( copy_from_user(start, udata, sz) )
     {
         err = -EFAULT;
         goto out;
     }
-    //update file position after write
-    *fpos = (*fpos+sz)%RBUFF_SZ;
     err = sz;
     size_t i=0;
     for(; i<sz; i++)
@@ -239,6 +255,7 @@ static int pl011_construct_device(struct pl011_dev *uart, struct class *klass)
     if( IS_ERR(device) )
         goto fail_step2;
     // device internal logic setup
+    mutex_init(&uart->open_lock);
     if(!uart->r_buff)
         uart->r_buff = kzalloc( RBUFF_SZ, GFP_KERNEL);
     if(!uart->w_buff)
@@ -247,7 +264,7 @@ static int pl011_construct_device(struct pl011_dev *uart, struct class *klass)
         goto fail_step3;
     uart->r_put = uart->r_buff;
     uart->r_get = uart->r_buff;
-    uart->io_start = PL011_PHYS_ADD;
+    uart->io_start = phys_add;
     uart->io_size = PL011_MEM_SZ;
     uart->io_mem_region = request_mem_region(uart->io_start, uart->io_size,
             "pl011_regs");
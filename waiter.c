@@ -1,28 +1,236 @@
+/* Capture daemon for one or many /dev/pl011_uartN nodes.
+ * - all ports are multiplexed with poll() and opened O_NONBLOCK, a readable
+ *   port is read until EAGAIN with large reads (READ_SZ),
+ * - every read becomes one record: rec_hdr (arrival time, port, length)
+ *   followed by the data, records are queued in an iovec batch and written
+ *   with a single writev() when the batch is full or FLUSH_MS passed,
+ * - output goes to PREFIX.0000, PREFIX.0001, ... a new file is started when
+ *   the current one grows past -r MiB,
+ * - every -i seconds per-port and total throughput is printed to stderr.
+ *
+ * usage: waiter [-o prefix] [-r rotate_mib] [-i report_s] [dev ...]
+ */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
-int main(int argc, char **argv)
+#define DEVPATH "/dev/pl011_uart0"
+#define MAX_PORTS 16
+#define READ_SZ 4096
+#define BATCH 64                //records per writev, 2 iovecs each
+#define FLUSH_MS 50
+#define REC_MAGIC 0xca97
+
+struct rec_hdr
+{
+    uint64_t ts_ns;             //CLOCK_REALTIME when read() returned
+    uint32_t len;
+    uint16_t port;
+    uint16_t magic;
+};
+
+struct port
+{
+    const char *path;
+    int fd;
+    unsigned long long bytes, last_bytes;
+};
+
+static struct port ports[MAX_PORTS];
+static int nports = 0;
+static struct rec_hdr hdrs[BATCH];
+static unsigned char data[BATCH][READ_SZ];
+static struct iovec iov[2*BATCH];
+static int nrec = 0;
+static int out = -1, out_seq = 0;
+static off_t out_sz = 0, rotate_sz = 64 << 20;
+static const char *prefix = "capture";
+static volatile sig_atomic_t quit = 0;
+
+static uint64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void on_quit(int sig)
 {
-    int fp;
-    fp = open("/dev/pl011_uart0", O_RDONLY);
-    if(fp<0)
+    quit = 1;
+}
+
+static void open_output(void)
+{
+    char name[256];
+    if(out >= 0)
+        close(out);
+    snprintf(name, sizeof(name), "%s.%04d", prefix, out_seq++);
+    out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0)
     {
-        perror("open");
+        perror(name);
         exit(EXIT_FAILURE);
     }
-    uint32_t data=0;
-    int ret=0;
-    for(;ret!=-1;)
+    out_sz = 0;
+}
+
+/* Writes the queued records with one writev, short writes are resumed */
+static void flush_batch(void)
+{
+    struct iovec *v = iov;
+    int cnt = 2*nrec;
+    while(cnt)
+    {
+        ssize_t ret = writev(out, v, cnt);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("writev");
+            exit(EXIT_FAILURE);
+        }
+        out_sz += ret;
+        while(cnt && (size_t)ret >= v->iov_len)
+        {
+            ret -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if(cnt)
+        {
+            v->iov_base = (char *)v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+    nrec = 0;
+    //records never straddle two files
+    if(out_sz >= rotate_sz)
+        open_output();
+}
+
+/* Reads a port dry, returns -1 when the port went away */
+static int drain(int idx)
+{
+    struct port *p = &ports[idx];
+    for(;;)
+    {
+        if(nrec == BATCH)
+            flush_batch();
+        ssize_t ret = read(p->fd, data[nrec], READ_SZ);
+        if(ret < 0)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        if(!ret)
+            return 0;
+        hdrs[nrec].ts_ns = clock_ns(CLOCK_REALTIME);
+        hdrs[nrec].len = ret;
+        hdrs[nrec].port = idx;
+        hdrs[nrec].magic = REC_MAGIC;
+        iov[2*nrec].iov_base = &hdrs[nrec];
+        iov[2*nrec].iov_len = sizeof(hdrs[nrec]);
+        iov[2*nrec+1].iov_base = data[nrec];
+        iov[2*nrec+1].iov_len = ret;
+        nrec++;
+        p->bytes += ret;
+    }
+}
+
+static void report(double secs)
+{
+    unsigned long long total = 0;
+    int i = 0;
+    for(; i < nports; i++)
+    {
+        unsigned long long d = ports[i].bytes - ports[i].last_bytes;
+        fprintf(stderr, "waiter: %s %.0f B/s\n", ports[i].path, d/secs);
+        ports[i].last_bytes = ports[i].bytes;
+        total += d;
+    }
+    fprintf(stderr, "waiter: total %.0f B/s\n", total/secs);
+}
+
+int main(int argc, char **argv)
+{
+    int report_s = 5, opt, i;
+    while( (opt = getopt(argc, argv, "o:r:i:")) != -1 )
+    {
+        switch(opt)
+        {
+            case 'o': prefix = optarg; break;
+            case 'r': rotate_sz = (off_t)atol(optarg) << 20; break;
+            case 'i': report_s = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-o prefix] [-r rotate_mib]"
+                        " [-i report_s] [dev ...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    for(i = optind; i < argc && nports < MAX_PORTS; i++)
+        ports[nports++].path = argv[i];
+    if(!nports)
+        ports[nports++].path = DEVPATH;
+    struct pollfd pfd[MAX_PORTS];
+    for(i = 0; i < nports; i++)
+    {
+        ports[i].fd = open(ports[i].path, O_RDONLY | O_NONBLOCK);
+        if(ports[i].fd < 0)
+        {
+            perror(ports[i].path);
+            exit(EXIT_FAILURE);
+        }
+        pfd[i].fd = ports[i].fd;
+        pfd[i].events = POLLIN;
+    }
+    signal(SIGINT, on_quit);
+    signal(SIGTERM, on_quit);
+    open_output();
+    uint64_t last_flush = clock_ns(CLOCK_MONOTONIC);
+    uint64_t last_report = last_flush;
+    while(!quit)
     {
-        ret=read(fp, &data, 4);
-        fprintf(stderr,"waiter: bytes: %d, val: %08x\n", ret, data);
-        usleep(200000);
+        int ret = poll(pfd, nports, FLUSH_MS);
+        if(ret < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        for(i = 0; ret > 0 && i < nports; i++)
+        {
+            if( (pfd[i].revents & POLLIN) && drain(i) < 0 )
+            {
+                perror(ports[i].path);
+                pfd[i].fd = -1;
+            }
+            else if(pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                fprintf(stderr, "waiter: %s gone\n", ports[i].path);
+                pfd[i].fd = -1;
+            }
+        }
+        uint64_t now = clock_ns(CLOCK_MONOTONIC);
+        if(nrec && now - last_flush >= FLUSH_MS*1000000ULL)
+        {
+            flush_batch();
+            last_flush = now;
+        }
+        if(report_s > 0 && now - last_report >= report_s*1000000000ULL)
+        {
+            report((now - last_report)*1e-9);
+            last_report = now;
+        }
     }
-    close(fp);
+    flush_batch();
+    close(out);
+    for(i = 0; i < nports; i++)
+        close(ports[i].fd);
     return 0;
 }